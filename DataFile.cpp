@@ -20,16 +20,219 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
 #include <cstdarg>
+#include <cerrno>
+#include <cstdlib>
 #include <fcntl.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <cstring>
 #include <string>
+#include <algorithm>
 #include "DataFile.h"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define DATAFILE_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
 using namespace std;
 
+// "ASCII" here means '\t', '\n', '\r' and ' ' to '~'.
+static inline bool is_ASCII_char(unsigned char c) throw() {
+	return c == '\t' || c == '\n' || c == '\r' || (c >= ' ' && c <= '~');
+}
+
+typedef size_t (*ASCII_span_function)(const unsigned char* data, size_t size);
+
+// Count the ASCII characters at the start of [data, data+size). Returns 'size'
+//  if there is no other character in the range.
+static size_t ASCII_span_scalar(const unsigned char* data, size_t size) throw() {
+	size_t i = 0;
+	while (i < size && is_ASCII_char(data[i]))
+		++ i;
+	return i;
+}
+
+#if DATAFILE_X86_SIMD
+// The vector kernels compare signed bytes, so everything from 0x80 up is
+//  negative and falls out of the ' '..'~' range together with the controls.
+
+__attribute__((target("sse2")))
+static size_t ASCII_span_sse2(const unsigned char* data, size_t size) {
+	const __m128i space_minus_1 = _mm_set1_epi8(' ' - 1);
+	const __m128i tilde_plus_1 = _mm_set1_epi8('~' + 1);
+	const __m128i tab = _mm_set1_epi8('\t');
+	const __m128i lf = _mm_set1_epi8('\n');
+	const __m128i cr = _mm_set1_epi8('\r');
+	
+	size_t i = 0;
+	for (; i + 16 <= size; i += 16) {
+		__m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+		__m128i ok = _mm_and_si128(_mm_cmpgt_epi8(x, space_minus_1), _mm_cmplt_epi8(x, tilde_plus_1));
+		ok = _mm_or_si128(ok, _mm_cmpeq_epi8(x, tab));
+		ok = _mm_or_si128(ok, _mm_cmpeq_epi8(x, lf));
+		ok = _mm_or_si128(ok, _mm_cmpeq_epi8(x, cr));
+		unsigned bad = ~static_cast<unsigned>(_mm_movemask_epi8(ok)) & 0xFFFFu;
+		if (bad)
+			return i + __builtin_ctz(bad);
+	}
+	return i + ASCII_span_scalar(data + i, size - i);
+}
+
+__attribute__((target("avx2")))
+static size_t ASCII_span_avx2(const unsigned char* data, size_t size) {
+	const __m256i space_minus_1 = _mm256_set1_epi8(' ' - 1);
+	const __m256i tilde_plus_1 = _mm256_set1_epi8('~' + 1);
+	const __m256i tab = _mm256_set1_epi8('\t');
+	const __m256i lf = _mm256_set1_epi8('\n');
+	const __m256i cr = _mm256_set1_epi8('\r');
+	
+	size_t i = 0;
+	for (; i + 32 <= size; i += 32) {
+		__m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+		__m256i ok = _mm256_and_si256(_mm256_cmpgt_epi8(x, space_minus_1), _mm256_cmpgt_epi8(tilde_plus_1, x));
+		ok = _mm256_or_si256(ok, _mm256_cmpeq_epi8(x, tab));
+		ok = _mm256_or_si256(ok, _mm256_cmpeq_epi8(x, lf));
+		ok = _mm256_or_si256(ok, _mm256_cmpeq_epi8(x, cr));
+		unsigned bad = ~static_cast<unsigned>(_mm256_movemask_epi8(ok));
+		if (bad)
+			return i + __builtin_ctz(bad);
+	}
+	return i + ASCII_span_sse2(data + i, size - i);
+}
+#endif
+
+static ASCII_span_function select_ASCII_span() throw() {
+#if DATAFILE_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return ASCII_span_avx2;
+	if (__builtin_cpu_supports("sse2"))
+		return ASCII_span_sse2;
+#endif
+	return ASCII_span_scalar;
+}
+
+// Chosen once at load time, before any thread can call it.
+static const ASCII_span_function ASCII_span = select_ASCII_span();
+
+typedef size_t (*single_byte_run_function)(const unsigned char* data, size_t size);
+
+// Count the bytes below 0x80 at the start of [data, data+size), i.e. the
+//  number of consecutive single-byte LEB128 values.
+static size_t single_byte_run_scalar(const unsigned char* data, size_t size) throw() {
+	size_t i = 0;
+	while (i < size && !(data[i] & 0x80))
+		++ i;
+	return i;
+}
+
+#if DATAFILE_X86_SIMD
+__attribute__((target("sse2")))
+static size_t single_byte_run_sse2(const unsigned char* data, size_t size) {
+	size_t i = 0;
+	for (; i + 16 <= size; i += 16) {
+		unsigned continued = static_cast<unsigned>(_mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i))));
+		if (continued)
+			return i + __builtin_ctz(continued);
+	}
+	return i + single_byte_run_scalar(data + i, size - i);
+}
+#endif
+
+static single_byte_run_function select_single_byte_run() throw() {
+#if DATAFILE_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2"))
+		return single_byte_run_sse2;
+#endif
+	return single_byte_run_scalar;
+}
+
+static const single_byte_run_function single_byte_run = select_single_byte_run();
+
+typedef size_t (*find_function)(const unsigned char* haystack, size_t size, const unsigned char* needle, size_t length);
+
+// Find the first occurrence of 'needle' in [haystack, haystack+size). Returns
+//  'size' if there is none. 'length' must be at least 2.
+static size_t find_scalar(const unsigned char* haystack, size_t size, const unsigned char* needle, size_t length) throw() {
+	if (size < length)
+		return size;
+	const unsigned char* last_start = haystack + (size - length);
+	const unsigned char* p = haystack;
+	while (p <= last_start) {
+		p = static_cast<const unsigned char*>(memchr(p, needle[0], static_cast<size_t>(last_start - p) + 1));
+		if (p == NULL)
+			break;
+		if (p[length-1] == needle[length-1] && memcmp(p + 1, needle + 1, length - 2) == 0)
+			return static_cast<size_t>(p - haystack);
+		++ p;
+	}
+	return size;
+}
+
+#if DATAFILE_X86_SIMD
+// Compare the first and the last byte of the needle against 16 or 32
+//  candidate positions at once, and only memcmp the positions where both
+//  agree. This keeps working when the first byte is common (e.g. 0x00).
+
+__attribute__((target("sse2")))
+static size_t find_sse2(const unsigned char* haystack, size_t size, const unsigned char* needle, size_t length) {
+	const __m128i first = _mm_set1_epi8(static_cast<char>(needle[0]));
+	const __m128i last = _mm_set1_epi8(static_cast<char>(needle[length-1]));
+	
+	size_t i = 0;
+	for (; i + length - 1 + 16 <= size; i += 16) {
+		__m128i block_first = _mm_loadu_si128(reinterpret_cast<const __m128i*>(haystack + i));
+		__m128i block_last = _mm_loadu_si128(reinterpret_cast<const __m128i*>(haystack + i + length - 1));
+		unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(block_first, first), _mm_cmpeq_epi8(block_last, last))));
+		while (mask) {
+			unsigned bit = static_cast<unsigned>(__builtin_ctz(mask));
+			if (memcmp(haystack + i + bit + 1, needle + 1, length - 2) == 0)
+				return i + bit;
+			mask &= mask - 1;
+		}
+	}
+	size_t rest = find_scalar(haystack + i, size - i, needle, length);
+	return rest == size - i ? size : i + rest;
+}
+
+__attribute__((target("avx2")))
+static size_t find_avx2(const unsigned char* haystack, size_t size, const unsigned char* needle, size_t length) {
+	const __m256i first = _mm256_set1_epi8(static_cast<char>(needle[0]));
+	const __m256i last = _mm256_set1_epi8(static_cast<char>(needle[length-1]));
+	
+	size_t i = 0;
+	for (; i + length - 1 + 32 <= size; i += 32) {
+		__m256i block_first = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(haystack + i));
+		__m256i block_last = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(haystack + i + length - 1));
+		unsigned mask = static_cast<unsigned>(_mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(block_first, first), _mm256_cmpeq_epi8(block_last, last))));
+		while (mask) {
+			unsigned bit = static_cast<unsigned>(__builtin_ctz(mask));
+			if (memcmp(haystack + i + bit + 1, needle + 1, length - 2) == 0)
+				return i + bit;
+			mask &= mask - 1;
+		}
+	}
+	size_t rest = find_sse2(haystack + i, size - i, needle, length);
+	return rest == size - i ? size : i + rest;
+}
+#endif
+
+static find_function select_find() throw() {
+#if DATAFILE_X86_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return find_avx2;
+	if (__builtin_cpu_supports("sse2"))
+		return find_sse2;
+#endif
+	return find_scalar;
+}
+
+static const find_function find_substring = select_find();
+
 TRException::TRException(const char* format, ...) {
 	va_list arguments;
 	va_start(arguments, format);
@@ -44,30 +247,112 @@ TRException::~TRException() throw() {
 }
 
 
-DataFile::DataFile(const char* path) : m_fd(open(path, O_RDONLY)), m_location(0) {
+DataFile::DataFile(const char* path, unsigned map_options) : m_data(NULL), m_filesize(0), m_fd(strcmp(path, "-") ? open(path, O_RDONLY) : dup(STDIN_FILENO)), m_streamed(false) {
 	if (m_fd == -1) {
 		throw TRException("DataFile::DataFile(const char*):\n\tFail to open \"%s\".", path);
 	}
 	
 	struct stat file_stat;
 	fstat(m_fd, &file_stat);
+	if (!S_ISREG(file_stat.st_mode)) {
+		this->read_stream(path);
+		return;
+	}
 	m_filesize = file_stat.st_size;
 	
-	m_data = static_cast<unsigned char*>(mmap(NULL, static_cast<size_t>(m_filesize), PROT_READ, MAP_SHARED, m_fd, 0));
+	int flags = MAP_SHARED;
+#ifdef MAP_POPULATE
+	if (map_options & MapPopulate)
+		flags |= MAP_POPULATE;
+#endif
+	m_data = static_cast<unsigned char*>(mmap(NULL, static_cast<size_t>(m_filesize), PROT_READ, flags, m_fd, 0));
 	if (m_data == MAP_FAILED) {
 		close(m_fd);
 		throw TRException("DataFile::DataFile(const char*):\n\tFail to map \"%s\" into memory.", path);
 	}
+	
+#ifdef MADV_HUGEPAGE
+	if (map_options & MapHugePages)
+		madvise(m_data, static_cast<size_t>(m_filesize), MADV_HUGEPAGE);
+#endif
+}
+
+bool DataFile::advise(off_t offset, off_t size, Access access) const throw() {
+	if (m_streamed || offset < 0 || offset >= m_filesize || size <= 0)
+		return false;
+	if (size > m_filesize - offset)
+		size = m_filesize - offset;
+	
+	int advice;
+	switch (access) {
+		case AccessRandom: advice = MADV_RANDOM; break;
+		case AccessWillNeed: advice = MADV_WILLNEED; break;
+		default: advice = MADV_NORMAL; break;
+	}
+	
+	// madvise() wants a page-aligned start.
+	off_t page_size = static_cast<off_t>(sysconf(_SC_PAGESIZE));
+	off_t start = offset / page_size * page_size;
+	return madvise(m_data + start, static_cast<size_t>(offset + size - start), advice) == 0;
+}
+
+void DataFile::apply_map_options(unsigned map_options) const throw() {
+	if (map_options & MapPopulate)
+		this->advise(0, m_filesize, AccessWillNeed);
+#ifdef MADV_HUGEPAGE
+	if (!m_streamed && m_filesize > 0 && (map_options & MapHugePages))
+		madvise(m_data, static_cast<size_t>(m_filesize), MADV_HUGEPAGE);
+#endif
+}
+
+// Read a non-seekable input to the end. The buffer grows geometrically, so
+//  the input is copied O(log n) times at most.
+void DataFile::read_stream(const char* path) {
+	size_t capacity = 1 << 20;
+	size_t size = 0;
+	unsigned char* buffer = static_cast<unsigned char*>(malloc(capacity));
+	
+	while (buffer != NULL) {
+		if (size == capacity) {
+			capacity *= 2;
+			unsigned char* new_buffer = static_cast<unsigned char*>(realloc(buffer, capacity));
+			if (new_buffer == NULL) {
+				free(buffer);
+				buffer = NULL;
+				break;
+			}
+			buffer = new_buffer;
+		}
+		ssize_t count = read(m_fd, buffer + size, capacity - size);
+		if (count < 0 && errno == EINTR)
+			continue;
+		if (count < 0) {
+			free(buffer);
+			buffer = NULL;
+		} else if (count == 0)
+			break;
+		else
+			size += static_cast<size_t>(count);
+	}
+	
+	if (buffer == NULL) {
+		close(m_fd);
+		throw TRException("DataFile::DataFile(const char*):\n\tFail to read \"%s\" into memory.", path);
+	}
+	
+	m_data = buffer;
+	m_filesize = static_cast<off_t>(size);
+	m_streamed = true;
 }
 		
-unsigned DataFile::read_integer() throw() {
+unsigned DataCursor::read_integer() throw() {
 	unsigned res;
 	memcpy(&res, m_data + m_location, sizeof(unsigned));
 	m_location += sizeof(unsigned);
 	return res;
 }
 
-const char* DataFile::read_string(size_t* p_string_length) throw() {
+const char* DataCursor::read_string(size_t* p_string_length) throw() {
 	const char* retval = reinterpret_cast<const char*>(m_data+m_location);
 	size_t string_length = strlen(retval);
 	if (p_string_length != NULL)
@@ -75,14 +360,20 @@ const char* DataFile::read_string(size_t* p_string_length) throw() {
 	m_location += string_length + 1;
 	return retval;
 }
-const char* DataFile::read_ASCII_string(size_t* p_string_length) throw() {
+const char* DataCursor::read_ASCII_string(size_t* p_string_length) throw() {
 	const char* retval = reinterpret_cast<const char*>(m_data+m_location);
-	const char* x = retval;
 	
 	size_t string_length = 0;
-	while (*x == '\t' || *x == '\n' || *x == '\r' || (*x >= ' ' && *x <= '~')) {
-		++x;
-		++string_length;
+	bool terminated = false;
+	if (m_location < m_size) {
+		size_t available = static_cast<size_t>(m_size - m_location);
+		string_length = ASCII_span(m_data + m_location, available);
+		terminated = string_length < available;
+	}
+	// Like strlen(), this does not stop at the end of the view.
+	if (!terminated) {
+		while (is_ASCII_char(m_data[m_location + string_length]))
+			++string_length;
 	}
 	
 	if (p_string_length != NULL)
@@ -95,27 +386,23 @@ const char* DataFile::read_ASCII_string(size_t* p_string_length) throw() {
 		return NULL;
 }
 
-const char* DataFile::peek_ASCII_Cstring_at(off_t offset, size_t* p_string_length) const throw() {
-	if (offset >= m_filesize)
+const char* DataCursor::peek_ASCII_Cstring_at(off_t offset, size_t* p_string_length) const throw() {
+	if (offset >= m_size)
 		return NULL;
 	
 	const char* retval = reinterpret_cast<const char*>(m_data + offset);
-	const char* x = retval;
 	
-	off_t string_length = 0;
-	while (*x == '\t' || *x == '\n' || *x == '\r' || (*x >= ' ' && *x <= '~')) {
-		++x;
-		++string_length;
-		if (offset + string_length >= m_filesize) {
-			if (p_string_length != NULL)
-				*p_string_length = 0;
-			return NULL;
-		}
+	size_t available = static_cast<size_t>(m_size - offset);
+	size_t string_length = ASCII_span(m_data + offset, available);
+	if (string_length == available) {
+		if (p_string_length != NULL)
+			*p_string_length = 0;
+		return NULL;
 	}
 	
-	if (*x == '\0') {
+	if (retval[string_length] == '\0') {
 		if (p_string_length != NULL)
-			*p_string_length = static_cast<size_t>(string_length);
+			*p_string_length = string_length;
 		return retval;
 	} else {
 		if (p_string_length != NULL)
@@ -124,42 +411,405 @@ const char* DataFile::peek_ASCII_Cstring_at(off_t offset, size_t* p_string_lengt
 	}
 }
 
-const unsigned char* DataFile::read_raw_data(size_t data_size) throw() {
+const unsigned char* DataCursor::read_raw_data(size_t data_size) throw() {
 	const unsigned char* retval = m_data+m_location;
 	m_location += data_size;
 	return retval;
 }
 
+template<typename T>
+size_t DataCursor::read_uleb128_array_impl(T* values, size_t count) throw() {
+	const unsigned char* p = m_data + m_location;
+	const unsigned char* end = m_data + m_size;
+	size_t decoded = 0;
+	while (decoded < count && p != end) {
+		if (!(*p & 0x80)) {
+			size_t run = single_byte_run(p, static_cast<size_t>(end - p));
+			if (run > count - decoded)
+				run = count - decoded;
+			for (size_t i = 0; i < run; ++ i)
+				values[decoded + i] = p[i];
+			decoded += run;
+			p += run;
+		} else {
+			uint64_t value;
+			const unsigned char* next = decode_uleb128(p, end, &value);
+			if (next == NULL) {
+				p = end;
+				break;
+			}
+			values[decoded++] = static_cast<T>(value);
+			p = next;
+		}
+	}
+	m_location = p - m_data;
+	return decoded;
+}
+
+size_t DataCursor::read_uleb128_array(uint32_t* values, size_t count) throw() {
+	return this->read_uleb128_array_impl(values, count);
+}
+
+size_t DataCursor::read_uleb128_array(uint64_t* values, size_t count) throw() {
+	return this->read_uleb128_array_impl(values, count);
+}
+
 DataFile::~DataFile() throw() {
-	munmap(m_data, static_cast<size_t>(m_filesize));
+	if (m_streamed)
+		free(m_data);
+	else
+		munmap(m_data, static_cast<size_t>(m_filesize));
 	close(m_fd);
 }
 
-bool DataFile::search_forward(const unsigned char* data, size_t length) throw() {
-	if (length > 0) {
-		while (true) {
-			if (static_cast<off_t>(length) + m_location > m_filesize) goto eof;
-			
-			const unsigned char* loc = static_cast<const unsigned char*>(std::memchr(m_data + m_location, data[0], m_filesize - m_location - length));
-			if (loc == NULL) goto eof;
-			
-			m_location = loc - m_data;
-			if (static_cast<off_t>(length) + m_location > m_filesize) goto eof;
-			
-			if (std::memcmp(m_data + m_location, data, length) == 0)
-				return true;
-			
-			++ m_location;
+DataFileSet::DataFileSet() {
+	pthread_mutex_init(&m_lock, NULL);
+}
+
+size_t DataFileSet::add_file(const char* path, unsigned map_options) {
+	Part part;
+	part.path = path;
+	part.map_options = map_options;
+	part.file = NULL;
+	m_parts.push_back(part);
+	return m_parts.size() - 1;
+}
+
+void DataFileSet::add_range(uint64_t address, uint64_t size, size_t index, off_t offset) {
+	Range range = {address, size, index, offset};
+	m_ranges.insert(upper_bound(m_ranges.begin(), m_ranges.end(), range), range);
+}
+
+void DataFileSet::set_map_options(size_t index, unsigned map_options) throw() {
+	pthread_mutex_lock(&m_lock);
+	Part& part = m_parts[index];
+	part.map_options = map_options;
+	if (part.file != NULL)
+		part.file->apply_map_options(map_options);
+	pthread_mutex_unlock(&m_lock);
+}
+
+void DataFileSet::advise(size_t index, off_t offset, off_t size, DataFile::Access access) {
+	pthread_mutex_lock(&m_lock);
+	Part& part = m_parts[index];
+	if (part.file != NULL) {
+		part.file->advise(offset, size, access);
+	} else {
+		Advice advice = {offset, size, access};
+		part.advice.push_back(advice);
+	}
+	pthread_mutex_unlock(&m_lock);
+}
+
+void DataFileSet::clear() throw() {
+	for (vector<Part>::iterator it = m_parts.begin(); it != m_parts.end(); ++ it)
+		delete it->file;
+	m_parts.clear();
+	m_ranges.clear();
+}
+
+const DataFile& DataFileSet::file(size_t index) const {
+	Part& part = const_cast<Part&>(m_parts[index]);
+	
+	// Once set, the pointer never changes, so only the first access needs
+	//  the lock.
+#if defined(__GNUC__)
+	DataFile* file = __atomic_load_n(&part.file, __ATOMIC_ACQUIRE);
+	if (file != NULL)
+		return *file;
+#endif
+	
+	pthread_mutex_lock(&m_lock);
+	if (part.file == NULL) {
+		try {
+			DataFile* new_file = new DataFile(part.path.c_str(), part.map_options);
+			for (vector<Advice>::const_iterator it = part.advice.begin(); it != part.advice.end(); ++ it)
+				new_file->advise(it->offset, it->size, it->access);
+			part.advice.clear();
+#if defined(__GNUC__)
+			__atomic_store_n(&part.file, new_file, __ATOMIC_RELEASE);
+#else
+			part.file = new_file;
+#endif
+		} catch (...) {
+			pthread_mutex_unlock(&m_lock);
+			throw;
 		}
-	} else
+	}
+	DataFile* retval = part.file;
+	pthread_mutex_unlock(&m_lock);
+	return *retval;
+}
+
+bool DataFileSet::read_at(size_t index, off_t offset, void* buffer, size_t size) const throw() {
+	const Part& part = m_parts[index];
+	
+	pthread_mutex_lock(&m_lock);
+	const DataFile* file = part.file;
+	pthread_mutex_unlock(&m_lock);
+	if (file != NULL) {
+		if (offset < 0 || offset + static_cast<off_t>(size) > file->filesize())
+			return false;
+		memcpy(buffer, file->data() + offset, size);
 		return true;
+	}
+	
+	int fd = open(part.path.c_str(), O_RDONLY);
+	if (fd < 0)
+		return false;
+	bool success = (pread(fd, buffer, size, offset) == static_cast<ssize_t>(size));
+	::close(fd);
+	return success;
+}
+
+bool DataFileSet::resolve(uint64_t address, size_t* p_index, off_t* p_offset) const throw() {
+	Range key = {address, 0, 0, 0};
+	vector<Range>::const_iterator it = upper_bound(m_ranges.begin(), m_ranges.end(), key);
+	if (it == m_ranges.begin())
+		return false;
+	-- it;
+	if (address - it->address >= it->size)
+		return false;
+	*p_index = it->index;
+	*p_offset = it->offset + static_cast<off_t>(address - it->address);
+	return true;
+}
+
+const DataFile* DataFileSet::locate(uint64_t address, off_t* p_offset) const {
+	size_t index;
+	if (!this->resolve(address, &index, p_offset))
+		return NULL;
+	return &this->file(index);
+}
 
+const unsigned char* DataFileSet::map_range(uint64_t address, uint64_t* p_begin, uint64_t* p_end) const {
+	Range key = {address, 0, 0, 0};
+	vector<Range>::const_iterator it = upper_bound(m_ranges.begin(), m_ranges.end(), key);
+	if (it == m_ranges.begin())
+		return NULL;
+	-- it;
+	if (address - it->address >= it->size)
+		return NULL;
+	
+	const DataFile& file = this->file(it->index);
+	if (it->offset >= file.filesize())
+		return NULL;
+	uint64_t available = static_cast<uint64_t>(file.filesize() - it->offset);
+	*p_begin = it->address;
+	*p_end = it->address + std::min(it->size, available);
+	if (address >= *p_end)
+		return NULL;
+	return file.data() + it->offset;
+}
+
+DataFileSet::~DataFileSet() throw() {
+	this->clear();
+	pthread_mutex_destroy(&m_lock);
+}
+
+const void* AddressSpaceView::bytes_at(uint64_t address, size_t size) const {
+	if (address < m_begin || address >= m_end) {
+		uint64_t begin, end;
+		const unsigned char* data = m_set->map_range(address, &begin, &end);
+		if (data == NULL)
+			return NULL;
+		m_begin = begin;
+		m_end = end;
+		m_data = data;
+	}
+	if (size > m_end - address)
+		return NULL;
+	return m_data + (address - m_begin);
+}
+
+const char* AddressSpaceView::string_at(uint64_t address) const {
+	const char* string = static_cast<const char*>(this->bytes_at(address, 1));
+	if (string == NULL || memchr(string, '\0', static_cast<size_t>(m_end - address)) == NULL)
+		return NULL;
+	return string;
+}
+
+MappedOutputFile::MappedOutputFile(const char* path, off_t initial_capacity)
+	: m_fd(open(path, O_RDWR | O_CREAT | O_TRUNC, 0666)), m_data(NULL), m_capacity(0), m_location(0), m_size(0) {
+	if (m_fd == -1) {
+		throw TRException("MappedOutputFile::MappedOutputFile(const char*, off_t):\n\tFail to open \"%s\".", path);
+	}
+	if (initial_capacity > 0 && !this->reserve(initial_capacity)) {
+		::close(m_fd);
+		m_fd = -1;
+		throw TRException("MappedOutputFile::MappedOutputFile(const char*, off_t):\n\tFail to allocate space for \"%s\".", path);
+	}
+}
+
+bool MappedOutputFile::reserve(off_t capacity) throw() {
+	if (capacity <= m_capacity)
+		return true;
+	if (m_fd < 0)
+		return false;
+	
+	// Grow geometrically so a series of small appends remaps O(log n) times.
+	off_t new_capacity = m_capacity * 2;
+	if (new_capacity < capacity)
+		new_capacity = capacity;
+	
+	bool allocated = false;
+#if defined(__linux__)
+	allocated = (fallocate(m_fd, 0, m_capacity, new_capacity - m_capacity) == 0);
+#endif
+	if (!allocated && ftruncate(m_fd, new_capacity) != 0)
+		return false;
+	
+	if (m_data != NULL)
+		munmap(m_data, static_cast<size_t>(m_capacity));
+	void* data = mmap(NULL, static_cast<size_t>(new_capacity), PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+	if (data == MAP_FAILED) {
+		m_data = NULL;
+		m_capacity = 0;
+		return false;
+	}
+	m_data = static_cast<unsigned char*>(data);
+	m_capacity = new_capacity;
+	return true;
+}
+
+unsigned char* MappedOutputFile::allocate(size_t size) throw() {
+	off_t end = m_location + static_cast<off_t>(size);
+	if (!this->reserve(end))
+		return NULL;
+	unsigned char* retval = m_data + m_location;
+	m_location = end;
+	if (m_size < end)
+		m_size = end;
+	return retval;
+}
+
+bool MappedOutputFile::write(const void* data, size_t size) throw() {
+	if (size == 0)
+		return true;
+	unsigned char* dest = this->allocate(size);
+	if (dest == NULL)
+		return false;
+	memcpy(dest, data, size);
+	return true;
+}
+
+bool MappedOutputFile::write_at(off_t offset, const void* data, size_t size) throw() {
+	if (offset < 0 || offset + static_cast<off_t>(size) > m_size)
+		return false;
+	memcpy(m_data + offset, data, size);
+	return true;
+}
+
+bool MappedOutputFile::close() throw() {
+	if (m_fd < 0)
+		return true;
+	bool success = true;
+	if (m_data != NULL && munmap(m_data, static_cast<size_t>(m_capacity)) != 0)
+		success = false;
+	m_data = NULL;
+	m_capacity = 0;
+	if (ftruncate(m_fd, m_size) != 0)
+		success = false;
+	if (::close(m_fd) != 0)
+		success = false;
+	m_fd = -1;
+	return success;
+}
+
+MappedOutputFile::~MappedOutputFile() throw() {
+	this->close();
+}
+
+bool DataCursor::search_forward(const unsigned char* data, size_t length) throw() {
+	if (length == 0)
+		return true;
+	if (static_cast<off_t>(length) + m_location > m_size)
+		goto eof;
+	
+	{
+		const unsigned char* haystack = m_data + m_location;
+		size_t size = static_cast<size_t>(m_size - m_location);
+		size_t found;
+		if (length == 1) {
+			const void* loc = memchr(haystack, data[0], size);
+			found = loc ? static_cast<size_t>(static_cast<const unsigned char*>(loc) - haystack) : size;
+		} else
+			found = find_substring(haystack, size, data, length);
+		
+		if (found == size)
+			goto eof;
+		m_location += found;
+		return true;
+	}
 	
 eof:
-	m_location = m_filesize;
+	m_location = m_size;
 	return false;
 }
 
+size_t PatternSet::add(const unsigned char* data, size_t length) {
+	m_patterns.push_back(vector<unsigned char>(data, data + length));
+	m_compiled = false;
+	return m_patterns.size() - 1;
+}
+
+void PatternSet::compile() {
+	// Build the trie. Missing transitions are marked with 0 (the root can
+	//  never be a child) and filled in below.
+	m_transitions.assign(256, 0);
+	m_first_output.assign(1, -1);
+	m_next_output.assign(m_patterns.size(), -1);
+	
+	for (size_t p = 0; p < m_patterns.size(); ++ p) {
+		const vector<unsigned char>& pattern = m_patterns[p];
+		if (pattern.empty())
+			continue;
+		unsigned state = 0;
+		for (size_t i = 0; i < pattern.size(); ++ i) {
+			unsigned& next = m_transitions[state * 256 + pattern[i]];
+			if (next == 0) {
+				next = static_cast<unsigned>(m_first_output.size());
+				m_first_output.push_back(-1);
+				m_transitions.resize(m_transitions.size() + 256, 0);
+			}
+			state = m_transitions[state * 256 + pattern[i]];
+		}
+		// Keep duplicates in the order they were added.
+		int* link = &m_first_output[state];
+		while (*link >= 0)
+			link = &m_next_output[*link];
+		*link = static_cast<int>(p);
+	}
+	
+	// Turn the trie into an automaton, breadth first so each state's failure
+	//  state is already complete when it is visited.
+	size_t state_count = m_first_output.size();
+	vector<unsigned> failure (state_count, 0);
+	m_output_link.assign(state_count, -1);
+	vector<unsigned> queue;
+	queue.reserve(state_count);
+	for (unsigned c = 0; c < 256; ++ c) {
+		if (m_transitions[c] != 0)
+			queue.push_back(m_transitions[c]);
+	}
+	for (size_t head = 0; head < queue.size(); ++ head) {
+		unsigned state = queue[head];
+		unsigned fail = failure[state];
+		m_output_link[state] = m_first_output[fail] >= 0 ? static_cast<int>(fail) : m_output_link[fail];
+		for (unsigned c = 0; c < 256; ++ c) {
+			unsigned& next = m_transitions[state * 256 + c];
+			unsigned fail_next = m_transitions[fail * 256 + c];
+			if (next != 0) {
+				failure[next] = fail_next;
+				queue.push_back(next);
+			} else
+				next = fail_next;
+		}
+	}
+	
+	m_compiled = true;
+}
+
 
 #if UNITTEST
 #include <cstdlib>
@@ -173,6 +823,11 @@ struct Foo {
     float f;
 };
 
+struct MatchRecorder {
+    std::vector<std::pair<size_t, off_t> > matches;
+    void operator()(size_t pattern, off_t offset) { matches.push_back(std::make_pair(pattern, offset)); }
+};
+
 #define XSTR(x) #x
 #define STR(x) XSTR(x)
 #define ASSERT(expr) if(!(expr)) { throw std::logic_error("Assert failed: " #expr " on line " STR(__LINE__)); }
@@ -192,72 +847,262 @@ int main () {
         DataFile f (filename);
         ASSERT(f.data() != NULL);
         ASSERT(f.filesize() == sizeof(info));
-        ASSERT(f.tell() == 0);
-        f.seek(4);
-        ASSERT(f.tell() == 4);
-        f.retreat(4);
-        ASSERT(f.tell() == 0);
-        f.advance(4);
-        ASSERT(f.tell() == 4);
-        f.rewind();
-        ASSERT(f.tell() == 0);
-        ASSERT(!f.is_eof());
-        f.seek(sizeof(info));
-        ASSERT(f.is_eof());
+        DataCursor c = f.cursor();
+        ASSERT(c.data() == f.data());
+        ASSERT(c.size() == f.filesize());
+        ASSERT(c.tell() == 0);
+        c.seek(4);
+        ASSERT(c.tell() == 4);
+        c.retreat(4);
+        ASSERT(c.tell() == 0);
+        c.advance(4);
+        ASSERT(c.tell() == 4);
+        c.rewind();
+        ASSERT(c.tell() == 0);
+        ASSERT(!c.is_eof());
+        c.seek(sizeof(info));
+        ASSERT(c.is_eof());
         
-        f.rewind();
-        ASSERT(f.read_integer() == 0x00345678u);
-        ASSERT(f.read_integer() == 0);
-        ASSERT(f.read_integer() == 0xbfe40000u);
-        ASSERT(f.read_char() == 'A');
-        ASSERT(f.read_char() == 'X');
-        const unsigned char* raw_data = f.read_raw_data(3);
-        ASSERT(f.tell() == 17);
+        c.rewind();
+        ASSERT(c.read_integer() == 0x00345678u);
+        ASSERT(c.read_integer() == 0);
+        ASSERT(c.read_integer() == 0xbfe40000u);
+        ASSERT(c.read_char() == 'A');
+        ASSERT(c.read_char() == 'X');
+        const unsigned char* raw_data = c.read_raw_data(3);
+        ASSERT(c.tell() == 17);
         ASSERT(raw_data[0] == 0xd2 && raw_data[1] == 4 && raw_data[2] == 0);
         
-        f.retreat(5);
-        ASSERT(f.tell() == 12);
+        c.retreat(5);
+        ASSERT(c.tell() == 12);
         size_t length = 0;
-        const char* string = f.read_string(&length);
+        const char* string = c.read_string(&length);
         ASSERT(!strcmp(string, "AX\xD2\x04"));
         ASSERT(length == 4);
-        ASSERT(f.tell() == 17);
-        f.retreat(5);
-        string = f.read_ASCII_string(&length);
+        ASSERT(c.tell() == 17);
+        c.retreat(5);
+        string = c.read_ASCII_string(&length);
         ASSERT(length == 2);
         ASSERT(!strncmp(string, "AX", length));
-        ASSERT(f.tell() == 14);
+        ASSERT(c.tell() == 14);
         
-        string = f.peek_ASCII_Cstring_at(0, &length);
+        string = c.peek_ASCII_Cstring_at(0, &length);
         ASSERT(length == 3);
         ASSERT(!strncmp(string, "xV4", length));
-        ASSERT(f.tell() == 14);
+        ASSERT(c.tell() == 14);
         
-        f.rewind();
-        ASSERT(f.copy_data<unsigned short>() == 0x5678);
-        ASSERT(f.tell() == 2);
-        f.seek(sizeof(info) - 3);
-        ASSERT(f.copy_data<unsigned short>() == 0x40e4);
-        ASSERT(f.read_data<unsigned short>() == NULL);
-        ASSERT(f.tell() == sizeof(info) - 1);
-        f.seek(4);
-        const Foo* foo = f.peek_data<Foo>();
+        c.rewind();
+        ASSERT(c.copy_data<unsigned short>() == 0x5678);
+        ASSERT(c.tell() == 2);
+        c.seek(sizeof(info) - 3);
+        ASSERT(c.copy_data<unsigned short>() == 0x40e4);
+        ASSERT(c.read_data<unsigned short>() == NULL);
+        ASSERT(c.tell() == sizeof(info) - 1);
+        c.seek(4);
+        const Foo* foo = c.peek_data<Foo>();
         ASSERT(foo->e == -0.625 && foo->a == 'A' && foo->b == 'X' && foo->c == 1234 && foo->f == 12345.0f);
-        ASSERT(f.tell() == 4);
-        ASSERT(!memcmp(f.peek_data<Foo>(), foo, sizeof(*foo)));
-        ASSERT(f.tell() == 4);
-        ASSERT(f.peek_data<Foo>(1) == NULL);
-        ASSERT(f.tell() == 4);
+        ASSERT(c.tell() == 4);
+        ASSERT(!memcmp(c.peek_data<Foo>(), foo, sizeof(*foo)));
+        ASSERT(c.tell() == 4);
+        ASSERT(c.peek_data<Foo>(1) == NULL);
+        ASSERT(c.tell() == 4);
+        ASSERT(*(c.peek_data_at<unsigned>(0)) == 0x00345678u);
+        ASSERT(c.tell() == 4);
+        ASSERT(c.peek_data_at<unsigned>(sizeof(info) - 3) == NULL);
+        ASSERT(c.tell() == 4);
+        unsigned char target[] = {0xE4, 0xBF};
+        ASSERT(c.search_forward(target, sizeof(target)));
+        ASSERT(c.tell() == 10);
+        c.advance(1);
+        ASSERT(!c.search_forward(target, sizeof(target)));
+        ASSERT(c.is_eof());
+        
+        DataCursor d = f.cursor(4);
+        c.rewind();
+        ASSERT(d.tell() == 4);
+        ASSERT(d.read_integer() == 0);
+        ASSERT(c.read_integer() == 0x00345678u);
+        ASSERT(d.tell() == 8 && c.tell() == 4);
         ASSERT(*(f.peek_data_at<unsigned>(0)) == 0x00345678u);
-        ASSERT(f.tell() == 4);
         ASSERT(f.peek_data_at<unsigned>(sizeof(info) - 3) == NULL);
-        ASSERT(f.tell() == 4);
-        unsigned char target[] = {0xE4, 0xBF};
-        ASSERT(f.search_forward(target, sizeof(target)));
-        ASSERT(f.tell() == 10);
-        f.advance(1);
-        ASSERT(!f.search_forward(target, sizeof(target)));
-        ASSERT(f.is_eof());
+        
+        DataCursor s = f.span(12, 5);
+        ASSERT(s.data() == f.data() + 12);
+        ASSERT(s.size() == 5);
+        ASSERT(s.read_char() == 'A');
+        ASSERT(s.peek_data_at<unsigned>(2) == NULL);
+        ASSERT(s.peek_data_at<unsigned>(0) != NULL);
+        s.seek(5);
+        ASSERT(s.is_eof());
+        ASSERT(f.span(16, 100).size() == 4);
+        ASSERT(s.span(2, 10).size() == 3);
+        ASSERT(*s.span(2, 10).peek_data<unsigned char>() == 0xD2);
+        
+        ASSERT(f.advise(0, sizeof(info), DataFile::AccessWillNeed));
+        ASSERT(f.advise(5, 1, DataFile::AccessRandom));
+        ASSERT(!f.advise(sizeof(info), 1, DataFile::AccessRandom));
+        {
+            DataFile g (filename, DataFile::MapPopulate | DataFile::MapHugePages);
+            ASSERT(!memcmp(g.data(), info, sizeof(info)));
+        }
+        
+        {
+            DataFileSet set;
+            ASSERT(set.add_file(filename) == 0);
+            ASSERT(set.add_file(filename) == 1);
+            set.add_range(0x2000, 8, 1, 12);
+            set.add_range(0x1000, 0x10, 0, 4);
+            size_t index;
+            off_t offset;
+            ASSERT(set.resolve(0x1004, &index, &offset) && index == 0 && offset == 8);
+            ASSERT(set.resolve(0x2007, &index, &offset) && index == 1 && offset == 19);
+            ASSERT(!set.resolve(0x2008, &index, &offset));
+            ASSERT(!set.resolve(0xfff, &index, &offset));
+            unsigned header;
+            ASSERT(set.read_at(1, 0, &header, sizeof(header)) && header == 0x00345678u);
+            ASSERT(!set.read_at(1, sizeof(info) - 2, &header, sizeof(header)));
+            // The options and advice apply whether the file is mapped yet or not.
+            set.set_map_options(1, DataFile::MapPopulate);
+            set.advise(1, 0, sizeof(info), DataFile::AccessRandom);
+            const DataFile* part = set.locate(0x2000, &offset);
+            ASSERT(part != NULL && part == &set.file(1) && part != &set.file(0));
+            set.set_map_options(1, DataFile::MapPopulate | DataFile::MapHugePages);
+            set.advise(1, 0, sizeof(info), DataFile::AccessNormal);
+            ASSERT(part->cursor(offset).read_char() == 'A');
+            ASSERT(set.locate(0x3000, &offset) == NULL);
+            ASSERT(set.read_at(1, sizeof(info) - 4, &header, sizeof(header)) && header == 0x4640E400u);
+        }
+        
+        {
+            DataFileSet set;
+            set.add_file(filename);
+            set.add_range(0x1000, 0x10, 0, 4);
+            set.add_range(0x2000, 8, 0, 12);
+            set.add_range(0x3000, 0x100, 0, 16);
+            AddressSpaceView view (set);
+            ASSERT(*view.at<unsigned>(0x100C) == 0x4640E400u);
+            ASSERT(view.at<unsigned>(0x100D) == NULL);
+            ASSERT(view.at<unsigned char>(0x1000, 0x10) != NULL);
+            ASSERT(view.at<unsigned char>(0x1000, 0x11) == NULL);
+            ASSERT(view.at<unsigned>(0x1000, ~static_cast<size_t>(0) / 2) == NULL);
+            ASSERT(*view.at<char>(0x2000) == 'A');
+            ASSERT(*view.at<unsigned>(0x1000) == 0);
+            ASSERT(view.string_at(0x2000) != NULL && !strcmp(view.string_at(0x2000), "AX\xD2\x04"));
+            ASSERT(view.string_at(0x2005) == NULL);
+            // The range is cut short at the end of the file.
+            ASSERT(*view.at<unsigned>(0x3000) == 0x4640E400u);
+            ASSERT(view.at<unsigned>(0x3001) == NULL);
+            ASSERT(view.at<char>(0x3004) == NULL);
+            ASSERT(view.at<char>(0x4000) == NULL);
+        }
+        
+        char out_filename[] = "/tmp/DF_unittest_out_XXXXXX";
+        int out_fd = mkstemp(out_filename);
+        close(out_fd);
+        {
+            MappedOutputFile o (out_filename, 3);
+            const unsigned char head[] = {0x78, 0x56, 0x34, 0x00, 0xE5, 0x8E, 0x26};
+            ASSERT(o.write(head, sizeof(head)));
+            ASSERT(o.write(head + 3, 1));
+            ASSERT(o.tell() == 8 && o.size() == 8);
+            const unsigned short patch = 0x1234;
+            ASSERT(o.write_at(1, &patch, sizeof(patch)));
+            ASSERT(!o.write_at(6, head, 4));
+            unsigned char* tail = o.allocate(8192);
+            ASSERT(tail != NULL);
+            tail[8191] = 0xAB;
+            ASSERT(o.close());
+        }
+        {
+            DataFile r (out_filename);
+            ASSERT(r.filesize() == 8 + 8192);
+            const unsigned char expected[] = {0x78, 0x34, 0x12, 0x00, 0xE5, 0x8E, 0x26, 0x00};
+            ASSERT(!memcmp(r.data(), expected, sizeof(expected)));
+            ASSERT(r.data()[8 + 8191] == 0xAB);
+        }
+        unlink(out_filename);
+        
+        int pipe_fds[2];
+        ASSERT(pipe(pipe_fds) == 0);
+        ASSERT(write(pipe_fds[1], info, sizeof(info)) == static_cast<ssize_t>(sizeof(info)));
+        close(pipe_fds[1]);
+        char pipe_path[32];
+        snprintf(pipe_path, sizeof(pipe_path), "/dev/fd/%d", pipe_fds[0]);
+        {
+            DataFile p (pipe_path);
+            ASSERT(p.is_streamed() && p.fd() == -1);
+            ASSERT(p.filesize() == sizeof(info));
+            ASSERT(!memcmp(p.data(), info, sizeof(info)));
+            ASSERT(p.cursor(12).read_char() == 'A');
+        }
+        close(pipe_fds[0]);
+        
+        unsigned char leb[] = {0xE5, 0x8E, 0x26, 0x7F, 0x80, 0x7F, 0x02, 0x80};
+        DataCursor l (leb, sizeof(leb));
+        bool truncated = true;
+        ASSERT(l.read_uleb128<unsigned>(&truncated) == 624485 && !truncated);
+        ASSERT(l.read_sleb128<int>() == -1);
+        ASSERT(l.read_sleb128<int>(&truncated) == -128 && !truncated);
+        ASSERT(l.read_uleb128<unsigned>() == 2);
+        ASSERT(l.read_uleb128<unsigned>(&truncated) == 0 && truncated);
+        ASSERT(l.is_eof());
+        l.rewind();
+        uint32_t leb_values[8];
+        ASSERT(l.read_uleb128_array(leb_values, 8) == 4);
+        ASSERT(leb_values[0] == 624485 && leb_values[1] == 0x7F && leb_values[2] == 0x3F80 && leb_values[3] == 2);
+        ASSERT(l.is_eof());
+        
+        unsigned char zeros[200] = {0};
+        zeros[150] = 1;
+        zeros[170] = 1;
+        unsigned char zero_needle[] = {0, 0, 0, 1, 0};
+        DataCursor z (zeros, sizeof(zeros));
+        ASSERT(z.search_forward(zero_needle, sizeof(zero_needle)));
+        ASSERT(z.tell() == 147);
+        z.advance(1);
+        ASSERT(z.search_forward(zero_needle, sizeof(zero_needle)));
+        ASSERT(z.tell() == 167);
+        z.advance(1);
+        ASSERT(!z.search_forward(zero_needle, sizeof(zero_needle)));
+        z.seek(196);
+        unsigned char tail_needle[] = {0, 0, 0, 0};
+        ASSERT(z.search_forward(tail_needle, sizeof(tail_needle)));
+        ASSERT(z.tell() == 196);
+        
+        MatchRecorder recorder;
+        PatternSet patterns;
+        const unsigned char he[] = "he", she[] = "she", hers[] = "hers", his[] = "his";
+        patterns.add(he, 2);
+        patterns.add(she, 3);
+        patterns.add(hers, 4);
+        patterns.add(his, 3);
+        patterns.compile();
+        const unsigned char ushers[] = "ushers his";
+        DataCursor(ushers, 10).foreach_match(patterns, recorder);
+        ASSERT(recorder.matches.size() == 4);
+        ASSERT(recorder.matches[0] == std::make_pair(size_t(1), off_t(1)));
+        ASSERT(recorder.matches[1] == std::make_pair(size_t(0), off_t(2)));
+        ASSERT(recorder.matches[2] == std::make_pair(size_t(2), off_t(2)));
+        ASSERT(recorder.matches[3] == std::make_pair(size_t(3), off_t(7)));
+        
+        // Long enough to go through the vector kernels, with the terminator
+        //  moved through every lane.
+        unsigned char text[100];
+        for (size_t stop = 0; stop < sizeof(text); ++ stop) {
+            for (size_t i = 0; i < sizeof(text); ++ i)
+                text[i] = static_cast<unsigned char>(i % 3 == 0 ? '\t' : ' ' + i % 95);
+            DataCursor t (text, sizeof(text));
+            ASSERT(t.peek_ASCII_Cstring_at(0) == NULL);
+            text[stop] = '\0';
+            ASSERT(t.peek_ASCII_Cstring_at(0, &length) != NULL && length == stop);
+            ASSERT(t.read_ASCII_string(&length) == (stop ? reinterpret_cast<const char*>(text) : NULL) && length == stop);
+            ASSERT(t.tell() == static_cast<off_t>(stop));
+            text[stop] = 0x80;
+            ASSERT(t.peek_ASCII_Cstring_at(0) == NULL);
+            text[stop] = 0x7F;
+            t.rewind();
+            ASSERT(t.read_ASCII_string(&length) == (stop ? reinterpret_cast<const char*>(text) : NULL) && length == stop);
+        }
     } catch (std::logic_error e) {
         printf("Unit test failed with exception:\n%s\n\n", e.what());
     }
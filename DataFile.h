@@ -23,9 +23,12 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>.
 #define DATAFILE_H
 
 #include <cstdio>
+#include <stdint.h>
+#include <pthread.h>
 #include <exception>
 #include <new>
 #include <string>
+#include <vector>
 
 class TRException : public std::exception {
 private:
@@ -36,25 +39,65 @@ public:
 	inline const char* what() const throw() { return m_error; }
 };
 
-class DataFile {
+// A set of byte strings to be looked for in a single pass (Aho-Corasick).
+//  Add all patterns, then compile() once; a compiled set is read-only and may
+//  be shared by cursors in different threads.
+class PatternSet {
+	friend class DataCursor;
+	
+	std::vector<std::vector<unsigned char> > m_patterns;
+	std::vector<unsigned> m_transitions;	// 256 per state.
+	std::vector<int> m_first_output;		// per state, the first pattern ending there.
+	std::vector<int> m_next_output;		// per pattern, the next one ending at the same state.
+	std::vector<int> m_output_link;		// per state, the longest proper suffix state with outputs.
+	bool m_compiled;
+	
+public:
+	PatternSet() throw() : m_compiled(false) {}
+	
+	// Returns the index reported for matches of this pattern. Empty patterns
+	//  never match.
+	std::size_t add(const unsigned char* data, std::size_t length);
+	void compile();
+	
+	inline std::size_t size() const throw() { return m_patterns.size(); }
+	inline std::size_t pattern_length(std::size_t index) const throw() { return m_patterns[index].size(); }
+	inline bool is_compiled() const throw() { return m_compiled; }
+};
+
+// A lightweight, copyable view over a range of memory-mapped data. Every
+//  cursor carries its own position and bounds, so any number of them can parse
+//  the same DataFile at once (e.g. from different threads) without sharing any
+//  state.
+class DataCursor {
 protected:
-	unsigned char* m_data;
-	off_t m_filesize;
-	int m_fd;
+	const unsigned char* m_data;
+	off_t m_size;
 	off_t m_location;
 	
 public:
-	DataFile(const char* path);
+	DataCursor(const unsigned char* data, off_t size, off_t location = 0) throw()
+		: m_data(data), m_size(size), m_location(location) {}
 	
 	inline const unsigned char* data() const throw() { return m_data; }
-	inline off_t filesize() const throw() { return m_filesize; }
+	inline off_t size() const throw() { return m_size; }
+	
+	// Create a sub-view of [offset, offset+size), clipped to this view.
+	// Positions in the new cursor are relative to 'offset'.
+	DataCursor span(off_t offset, off_t size) const throw() {
+		if (offset > m_size)
+			offset = m_size;
+		if (size > m_size - offset)
+			size = m_size - offset;
+		return DataCursor(m_data + offset, size);
+	}
 	
 	inline void seek(off_t new_location) throw() { m_location = new_location; }
 	inline off_t tell() const throw() { return m_location; }
 	inline void advance(off_t delta) throw() { m_location += delta; }
 	inline void retreat(off_t neg_delta) throw() { m_location -= neg_delta; }
 	inline void rewind() throw() { m_location = 0; }
-	inline bool is_eof() const throw() { return m_location == m_filesize; }
+	inline bool is_eof() const throw() { return m_location == m_size; }
 	
 	unsigned read_integer() throw();
 	char read_char() throw() { return static_cast<char>(m_data[m_location++]); }
@@ -69,7 +112,7 @@ public:
 	
 	template<typename T>
 	const T* read_data() throw() {
-		if (m_location + static_cast<off_t>(sizeof(T)) <= m_filesize) {
+		if (m_location + static_cast<off_t>(sizeof(T)) <= m_size) {
 			const T* retval = reinterpret_cast<const T*>(m_data + m_location);
 			m_location += sizeof(T);
 			return retval;
@@ -83,8 +126,8 @@ public:
 	T copy_data() throw() { return *(this->read_data<T>()); }
 	
 	template<typename T>
-	inline const T* peek_data(unsigned items_after = 0) throw() {
-		if (m_location+static_cast<off_t>((1+items_after)*sizeof(T)) <= m_filesize) {
+	inline const T* peek_data(unsigned items_after = 0) const throw() {
+		if (m_location+static_cast<off_t>((1+items_after)*sizeof(T)) <= m_size) {
 			return reinterpret_cast<const T*>(m_data + m_location) + items_after;
 		} else
 			return NULL;
@@ -92,52 +135,352 @@ public:
 	
 	template<typename T>
 	inline const T* peek_data_at(off_t offset) const throw() {
-		if (offset+static_cast<off_t>(sizeof(T)) <= m_filesize) {
+		if (offset+static_cast<off_t>(sizeof(T)) <= m_size) {
 			return reinterpret_cast<const T*>(m_data + offset);
 		} else
 			return NULL;
 	}
 	
+	// LEB128 values never read past the end of the view. A value cut short by
+	//  the end sets *p_truncated (if given) and leaves the cursor at the end;
+	//  the bits read so far are returned. Bits beyond 64 are dropped.
 	template<typename T>
-	T read_uleb128() throw() {
-		T res = 0;
-		int bit = 0;
-		unsigned char c;
-		do {
-			c = static_cast<unsigned char>(read_char());
-			T s = c & 0x7F;
-			res |= s << bit;
-			bit += 7;
-		} while (c & 0x80);
-		return res;		
+	T read_uleb128(bool* p_truncated = NULL) throw() {
+		uint64_t res;
+		const unsigned char* end = m_data + m_size;
+		const unsigned char* next = decode_uleb128(m_data + m_location, end, &res);
+		this->finish_leb128(next, end, p_truncated);
+		return static_cast<T>(res);
 	}
 	
 	template<typename T>
-	T read_sleb128() throw() {
-		T res = 0;
-		int bit = 0;
-		signed char c;
+	T read_sleb128(bool* p_truncated = NULL) throw() {
+		uint64_t res = 0;
+		unsigned bit = 0;
+		const unsigned char* p = m_data + m_location;
+		const unsigned char* end = m_data + m_size;
+		unsigned char c = 0;
 		do {
-			c = read_char();
-			T s = c & 0x7F;
-			res |= s << bit;
+			if (p == end) {
+				this->finish_leb128(NULL, end, p_truncated);
+				return static_cast<T>(res);
+			}
+			c = *p++;
+			if (bit < 64)
+				res |= static_cast<uint64_t>(c & 0x7F) << bit;
 			bit += 7;
 		} while (c & 0x80);
-		if (c & 0x40) {
-			T n1 = -1;
-			res |= n1 << bit;
+		if ((c & 0x40) && bit < 64)
+			res |= ~static_cast<uint64_t>(0) << bit;
+		this->finish_leb128(p, end, p_truncated);
+		return static_cast<T>(res);
+	}
+	
+	// Decode up to 'count' consecutive ULEB128 values. Returns how many were
+	//  decoded, which is less than 'count' only if the view ends first. A
+	//  run of single-byte values (typical of LC_FUNCTION_STARTS) is decoded
+	//  16 at a time where SSE2 is available.
+	std::size_t read_uleb128_array(uint32_t* values, std::size_t count) throw();
+	std::size_t read_uleb128_array(uint64_t* values, std::size_t count) throw();
+	
+	// Decode one ULEB128 value from [p, end). Returns the byte after it, or
+	//  NULL if the value does not end before 'end'.
+	static inline const unsigned char* decode_uleb128(const unsigned char* p, const unsigned char* end, uint64_t* p_value) throw() {
+		// Values of up to 4 bytes need no bounds checks when there is room.
+		if (end - p >= 4) {
+			uint64_t c = p[0];
+			if (!(c & 0x80)) { *p_value = c; return p + 1; }
+			uint64_t res = c & 0x7F;
+			c = p[1];
+			if (!(c & 0x80)) { *p_value = res | c << 7; return p + 2; }
+			res |= (c & 0x7F) << 7;
+			c = p[2];
+			if (!(c & 0x80)) { *p_value = res | c << 14; return p + 3; }
+			res |= (c & 0x7F) << 14;
+			c = p[3];
+			if (!(c & 0x80)) { *p_value = res | c << 21; return p + 4; }
+		}
+		
+		uint64_t res = 0;
+		unsigned bit = 0;
+		while (p != end) {
+			unsigned char c = *p++;
+			if (bit < 64)
+				res |= static_cast<uint64_t>(c & 0x7F) << bit;
+			bit += 7;
+			if (!(c & 0x80)) {
+				*p_value = res;
+				return p;
+			}
 		}
-		return res;		
+		*p_value = res;
+		return NULL;
+	}
+	
+private:
+	inline void finish_leb128(const unsigned char* next, const unsigned char* end, bool* p_truncated) throw() {
+		if (p_truncated != NULL)
+			*p_truncated = (next == NULL);
+		m_location = (next ? next : end) - m_data;
 	}
 	
+	template<typename T>
+	std::size_t read_uleb128_array_impl(T* values, std::size_t count) throw();
+	
+public:
+	// Move to the next occurrence of 'data' at or after the current location.
+	//  On failure the cursor is left at the end.
 	bool search_forward(const unsigned char* data, size_t length) throw();
 	
-	~DataFile() throw();
+	// Report every occurrence of every pattern in 'patterns' from the current
+	//  location to the end, including overlapping ones, as
+	//  visitor(pattern_index, offset). The cursor does not move.
+	template<typename Visitor>
+	void foreach_match(const PatternSet& patterns, Visitor& visitor) const {
+		if (!patterns.m_compiled)
+			return;
+		
+		const unsigned* transitions = &patterns.m_transitions[0];
+		unsigned state = 0;
+		for (off_t i = m_location; i < m_size; ++ i) {
+			state = transitions[state * 256 + m_data[i]];
+			int output_state = patterns.m_first_output[state] >= 0 ? static_cast<int>(state) : patterns.m_output_link[state];
+			for (; output_state >= 0; output_state = patterns.m_output_link[output_state]) {
+				for (int p = patterns.m_first_output[output_state]; p >= 0; p = patterns.m_next_output[p])
+					visitor(static_cast<std::size_t>(p), i + 1 - static_cast<off_t>(patterns.m_patterns[p].size()));
+			}
+		}
+	}
 };
 
 template<>
-inline const void* DataFile::peek_data_at<void>(off_t offset) const throw() {
+inline const void* DataCursor::peek_data_at<void>(off_t offset) const throw() {
     return m_data + offset;
 }
 
+// The memory-mapped file. This only holds the immutable mapping; all parsing
+//  is done through DataCursor's created by cursor() or span().
+//
+// Inputs which cannot be mapped (pipes, terminals, or "-" for stdin) are
+//  read into memory instead, so a cache can be decached straight out of a
+//  decompression pipeline.
+class DataFile {
+protected:
+	unsigned char* m_data;
+	off_t m_filesize;
+	int m_fd;
+	bool m_streamed;
+	
+	void read_stream(const char* path);
+	
+private:
+	DataFile(const DataFile&);
+	DataFile& operator=(const DataFile&);
+	
+public:
+	// Options for mapping the file. They are requests only: they are ignored
+	//  where the system does not support them, and for streamed inputs.
+	enum MapOptions {
+		MapDefault = 0,
+		MapPopulate = 1,	// Read the whole file in while mapping it (MAP_POPULATE).
+		MapHugePages = 2	// Ask for transparent huge pages (MADV_HUGEPAGE).
+	};
+	
+	// How a range of the file is going to be accessed, see advise().
+	enum Access {
+		AccessNormal,
+		AccessRandom,
+		AccessWillNeed
+	};
+	
+	DataFile(const char* path, unsigned map_options = MapDefault);
+	
+	// Tell the kernel how [offset, offset+size) will be accessed
+	//  (madvise()). Returns false if the hint was not taken.
+	bool advise(off_t offset, off_t size, Access access) const throw();
+	
+	// Apply 'map_options' to the existing mapping. MapPopulate can then only
+	//  ask for the file to be read in ahead (MADV_WILLNEED).
+	void apply_map_options(unsigned map_options) const throw();
+	
+	inline const unsigned char* data() const throw() { return m_data; }
+	inline off_t filesize() const throw() { return m_filesize; }
+	// The descriptor the data was mapped from, or -1 if it was streamed.
+	inline int fd() const throw() { return m_streamed ? -1 : m_fd; }
+	inline bool is_streamed() const throw() { return m_streamed; }
+	
+	inline DataCursor cursor(off_t location = 0) const throw() {
+		return DataCursor(m_data, m_filesize, location);
+	}
+	inline DataCursor span(off_t offset, off_t size) const throw() {
+		return this->cursor().span(offset, size);
+	}
+	
+	inline const char* peek_ASCII_Cstring_at(off_t offset, std::size_t* p_string_length = NULL) const throw() {
+		return this->cursor().peek_ASCII_Cstring_at(offset, p_string_length);
+	}
+	
+	template<typename T>
+	inline const T* peek_data_at(off_t offset) const throw() {
+		return this->cursor().peek_data_at<T>(offset);
+	}
+	
+	~DataFile() throw();
+};
+
+// Several files seen through one address space, e.g. a dyld shared cache
+//  split into a main file and subcaches. A file is only opened and mapped
+//  the first time it is asked for, so parts which are never touched cost
+//  nothing. All files and ranges must be added before the set is shared
+//  between threads; file() and locate() may then be called from any thread.
+class DataFileSet {
+	struct Advice {
+		off_t offset;
+		off_t size;
+		DataFile::Access access;
+	};
+	
+	struct Part {
+		std::string path;
+		unsigned map_options;
+		std::vector<Advice> advice;	// given once the file is mapped.
+		DataFile* file;
+	};
+	
+	struct Range {
+		uint64_t address;
+		uint64_t size;
+		std::size_t index;
+		off_t offset;
+		
+		bool operator<(const Range& other) const throw() { return address < other.address; }
+	};
+	
+	std::vector<Part> m_parts;
+	std::vector<Range> m_ranges;	// sorted by address.
+	mutable pthread_mutex_t m_lock;
+	
+private:
+	DataFileSet(const DataFileSet&);
+	DataFileSet& operator=(const DataFileSet&);
+	
+public:
+	DataFileSet();
+	
+	// Register a file without opening it. Returns its index.
+	std::size_t add_file(const char* path, unsigned map_options = DataFile::MapDefault);
+	
+	// Declare that [address, address+size) is stored in file 'index' from
+	//  'offset' on.
+	void add_range(uint64_t address, uint64_t size, std::size_t index, off_t offset);
+	
+	// Map file 'index' with 'map_options' if it is not mapped yet, or apply
+	//  the options to it otherwise (see DataFile::apply_map_options()).
+	void set_map_options(std::size_t index, unsigned map_options) throw();
+	
+	// Tell how [offset, offset+size) of file 'index' will be accessed (see
+	//  DataFile::advise()), now if the file is mapped, or else once it is.
+	void advise(std::size_t index, off_t offset, off_t size, DataFile::Access access);
+	
+	// Close and forget all files.
+	void clear() throw();
+	
+	inline std::size_t file_count() const throw() { return m_parts.size(); }
+	inline const char* path_of_file(std::size_t index) const throw() { return m_parts[index].path.c_str(); }
+	
+	// The file at 'index', opened and mapped on first use. Throws
+	//  TRException if it cannot be opened.
+	const DataFile& file(std::size_t index) const;
+	
+	// Copy bytes out of a file without mapping it, e.g. to read a header.
+	bool read_at(std::size_t index, off_t offset, void* buffer, std::size_t size) const throw();
+	
+	// Find which file holds an address, in O(log n).
+	bool resolve(uint64_t address, std::size_t* p_index, off_t* p_offset) const throw();
+	
+	// As resolve(), but returns the (mapped) file, or NULL.
+	const DataFile* locate(uint64_t address, off_t* p_offset) const;
+	
+	// Find the range holding 'address' and return the mapped data at its
+	//  start. The range is returned as [*p_begin, *p_end), cut short at the
+	//  end of the file. Returns NULL if no file maps the address.
+	const unsigned char* map_range(uint64_t address, uint64_t* p_begin, uint64_t* p_end) const;
+	
+	~DataFileSet() throw();
+};
+
+// Reads a DataFileSet by address on behalf of a single thread. Lookups tend
+//  to cluster, so the range of the last one is remembered, and only a miss
+//  goes back to the set. Every result lies wholly within one range.
+class AddressSpaceView {
+	const DataFileSet* m_set;
+	mutable uint64_t m_begin, m_end;
+	mutable const unsigned char* m_data;	// the byte at m_begin.
+	
+public:
+	explicit AddressSpaceView(const DataFileSet& set) throw() : m_set(&set), m_begin(0), m_end(0), m_data(NULL) {}
+	
+	// The 'size' bytes at 'address', or NULL if they are not all mapped.
+	const void* bytes_at(uint64_t address, std::size_t size) const;
+	
+	// 'count' objects of type T at 'address', or NULL if they are not all
+	//  mapped.
+	template<typename T>
+	inline const T* at(uint64_t address, std::size_t count = 1) const {
+		if (count > ~static_cast<std::size_t>(0) / sizeof(T))
+			return NULL;
+		return static_cast<const T*>(this->bytes_at(address, count * sizeof(T)));
+	}
+	
+	// The C string at 'address', or NULL if it is not terminated within its
+	//  range.
+	const char* string_at(uint64_t address) const;
+};
+
+// A file written through a shared, writable mapping. Space is preallocated
+//  (fallocate() where available, ftruncate() otherwise) ahead of the writes,
+//  so appending and patching are plain stores; the file is cut to the size
+//  actually written on close().
+class MappedOutputFile {
+protected:
+	int m_fd;
+	unsigned char* m_data;
+	off_t m_capacity;
+	off_t m_location;
+	off_t m_size;
+	
+private:
+	MappedOutputFile(const MappedOutputFile&);
+	MappedOutputFile& operator=(const MappedOutputFile&);
+	
+public:
+	// Create or truncate the file at 'path'.
+	MappedOutputFile(const char* path, off_t initial_capacity = 0);
+	
+	inline int fd() const throw() { return m_fd; }
+	inline unsigned char* data() throw() { return m_data; }
+	inline off_t size() const throw() { return m_size; }
+	inline off_t tell() const throw() { return m_location; }
+	inline void seek(off_t new_location) throw() { m_location = new_location; }
+	inline bool is_open() const throw() { return m_fd >= 0; }
+	
+	// Make sure the file can hold 'capacity' bytes without remapping.
+	bool reserve(off_t capacity) throw();
+	
+	// Claim the next 'size' bytes and return them, e.g. to be filled in
+	//  through fd(). Returns NULL if the file cannot grow.
+	unsigned char* allocate(std::size_t size) throw();
+	
+	bool write(const void* data, std::size_t size) throw();
+	
+	// Overwrite bytes which were already written.
+	bool write_at(off_t offset, const void* data, std::size_t size) throw();
+	
+	// Unmap, truncate to the written size and close. Returns false if any of
+	//  these failed.
+	bool close() throw();
+	
+	~MappedOutputFile() throw();
+};
+
 #endif
@@ -58,19 +58,33 @@
 // END LEGALESE
 //------------------------------------------------------------------------------
 
-// g++ -o dyld_decache -O3 -Wall -Wextra -std=c++98 /usr/local/lib/libboost_filesystem-mt.a /usr/local/lib/libboost_system-mt.a dyld_decache.cpp DataFile.cpp
+// g++ -o dyld_decache -O3 -Wall -Wextra -std=c++98 /usr/local/lib/libboost_filesystem-mt.a /usr/local/lib/libboost_system-mt.a dyld_decache.cpp DataFile.cpp -lpthread
 
 #include <unistd.h>
+#include <fcntl.h>
+#if defined(__linux__)
+#include <sys/sendfile.h>
+#endif
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#include <cerrno>
 #include <cstdio>
+#include <cstdlib>
 #include <stdint.h>
 #include <getopt.h>
+#include <pthread.h>
 #include "DataFile.h"
 #include <string>
 #include <vector>
+#include <deque>
+#include <map>
+#include <algorithm>
 #define BOOST_FILESYSTEM_VERSION 3
 #include <boost/filesystem.hpp>
 #include <utility>
 #include <boost/unordered_map.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/foreach.hpp>
 
 struct dyld_cache_header {
@@ -87,6 +101,8 @@ typedef uint64_t		mach_vm_offset_t;
 typedef uint64_t		mach_vm_size_t;
 typedef int32_t vm_prot_t;
 
+#define VM_PROT_READ	((vm_prot_t) 0x01)
+
 struct shared_file_mapping_np {
 	mach_vm_address_t	sfm_address;
 	mach_vm_size_t		sfm_size;
@@ -117,6 +133,17 @@ struct mach_header {
 	uint32_t	flags;
 };
 
+struct mach_header_64 {
+	uint32_t	magic;
+	cpu_type_t	cputype;
+	cpu_subtype_t	cpusubtype;
+	uint32_t	filetype;
+	uint32_t	ncmds;
+	uint32_t	sizeofcmds;
+	uint32_t	flags;
+	uint32_t	reserved;
+};
+
 struct load_command {
 	uint32_t cmd;
 	uint32_t cmdsize;
@@ -299,56 +326,70 @@ struct nlist {
 	uint32_t n_value;
 };
 
+struct nlist_64 {
+	uint32_t n_strx;
+	uint8_t n_type;
+	uint8_t n_sect;
+	uint16_t n_desc;
+	uint64_t n_value;
+};
+
+template <typename P>
 struct class_t {
-    uint32_t isa;
-    uint32_t superclass;
-    uint32_t cache;
-    uint32_t vtable;
-    uint32_t data;
+    P isa;
+    P superclass;
+    P cache;
+    P vtable;
+    P data;
 };
 
+template <typename P>
 struct class_ro_t {
     uint32_t flags;
     uint32_t instanceStart;
     uint32_t instanceSize;
-    uint32_t ivarLayout;
-    uint32_t name;
-    uint32_t baseMethods;
-    uint32_t baseProtocols;
-    uint32_t ivars;
-    uint32_t weakIvarLayout;
-    uint32_t baseProperties;
+    P ivarLayout;
+    P name;
+    P baseMethods;
+    P baseProtocols;
+    P ivars;
+    P weakIvarLayout;
+    P baseProperties;
 };
 
+template <typename P>
 struct method_t {
-    uint32_t name;
-    uint32_t types;
-    uint32_t imp;
+    P name;
+    P types;
+    P imp;
 };
 
+template <typename P>
 struct property_t {
-    uint32_t name;
-    uint32_t attributes;
+    P name;
+    P attributes;
 };
 
+template <typename P>
 struct protocol_t {
-    uint32_t isa;
-    uint32_t name;
-    uint32_t protocols;
-    uint32_t instanceMethods;
-    uint32_t classMethods;
-    uint32_t optionalInstanceMethods;
-    uint32_t optionalClassMethods;
-    uint32_t instanceProperties;
+    P isa;
+    P name;
+    P protocols;
+    P instanceMethods;
+    P classMethods;
+    P optionalInstanceMethods;
+    P optionalClassMethods;
+    P instanceProperties;
 };
 
+template <typename P>
 struct category_t {
-    uint32_t name;
-    uint32_t cls;
-    uint32_t instanceMethods;
-    uint32_t classMethods;
-    uint32_t protocols;
-    uint32_t instanceProperties;
+    P name;
+    P cls;
+    P instanceMethods;
+    P classMethods;
+    P protocols;
+    P instanceProperties;
 };
 
 struct uuid_command : load_command {
@@ -397,18 +438,226 @@ static bool streq(const char x[16], const char* y) {
     return strncmp(x, y, 16) == 0;
 }
 
-static long write_uleb128(FILE* f, unsigned u) {
-    uint8_t buf[16];
-    int byte_count = 0;
-    while (u) {
-        buf[byte_count++] = u | 0x80;
-        u >>= 7;
+// The structures which differ between 32-bit and 64-bit images. The classes
+//  handling a single image are templates on one of these, so each pointer
+//  width is compiled separately. Only little-endian images are supported, as
+//  are all shared caches.
+struct Arch32 {
+    typedef uint32_t pointer_t;
+    typedef mach_header mach_header_t;
+    typedef segment_command segment_command_t;
+    typedef section section_t;
+    typedef nlist nlist_t;
+    static const uint32_t magic = 0xfeedface;
+    static const uint32_t segment_cmd = LC_SEGMENT;
+    static const uint32_t dylib_module_size = 52;
+};
+
+struct Arch64 {
+    typedef uint64_t pointer_t;
+    typedef mach_header_64 mach_header_t;
+    typedef segment_command_64 segment_command_t;
+    typedef section_64 section_t;
+    typedef nlist_64 nlist_t;
+    static const uint32_t magic = 0xfeedfacf;
+    static const uint32_t segment_cmd = LC_SEGMENT_64;
+    static const uint32_t dylib_module_size = 56;
+};
+
+// Append 'size' bytes from the input file to the output file. The bytes are
+//  copied inside the kernel with copy_file_range() or sendfile() when
+//  possible, and fall back to a copy between the two mappings.
+static bool copy_input_range(MappedOutputFile& file, int src_fd, const unsigned char* src_data, off_t src_offset, size_t size) {
+    off_t dst_offset = file.tell();
+    unsigned char* dst_data = file.allocate(size);
+    if (dst_data == NULL)
+        return false;
+
+    size_t copied = 0;
+#if defined(__linux__)
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+    while (copied < size) {
+        loff_t in_offset = src_offset + copied;
+        loff_t out_offset = dst_offset + copied;
+        ssize_t res = copy_file_range(src_fd, &in_offset, file.fd(), &out_offset, size - copied, 0);
+        if (res < 0 && errno == EINTR)
+            continue;
+        if (res <= 0)
+            break;
+        copied += res;
+    }
+#endif
+    if (copied < size && lseek(file.fd(), dst_offset + copied, SEEK_SET) >= 0) {
+        while (copied < size) {
+            off_t in_offset = src_offset + copied;
+            ssize_t res = sendfile(file.fd(), src_fd, &in_offset, size - copied);
+            if (res < 0 && errno == EINTR)
+                continue;
+            if (res <= 0)
+                break;
+            copied += res;
+        }
     }
-    buf[byte_count-1] &= ~0x80;
-    fwrite(buf, byte_count, sizeof(*buf), f);
-    return byte_count;
+#else
+    (void)src_fd;
+    (void)src_offset;
+#endif
+    memcpy(dst_data + copied, src_data + copied, size - copied);
+    return true;
 }
 
+// The decached file being built. It is a sequence of in-memory pieces and of
+//  ranges to be copied verbatim from the cache file. The latter are never
+//  read into user space; patches which land on them are kept aside and
+//  stored into the output mapping once the ranges have been copied.
+class OutputImage {
+    struct Piece {
+        long offset;
+        size_t size;
+        const unsigned char* src_data;  // NULL if the piece is in memory.
+        int src_fd;
+        off_t src_offset;
+        std::vector<unsigned char> bytes;
+    };
+
+    struct Patch {
+        long offset;
+        size_t size;
+        size_t data_index;
+    };
+
+    // Ranges smaller than this are not worth a system call of their own.
+    enum { min_copy_size = 16384 };
+
+    std::deque<Piece> _pieces;
+    std::vector<Patch> _patches;
+    std::vector<unsigned char> _patch_data;
+    long _size;
+
+    Piece& memory_piece() {
+        if (_pieces.empty() || _pieces.back().src_data) {
+            _pieces.push_back(Piece());
+            Piece& piece = _pieces.back();
+            piece.offset = _size;
+            piece.size = 0;
+            piece.src_data = NULL;
+            piece.src_fd = -1;
+            piece.src_offset = 0;
+        }
+        return _pieces.back();
+    }
+
+public:
+    OutputImage() : _size(0) {}
+
+    long tell() const { return _size; }
+
+    void write(const void* data, size_t size) {
+        const unsigned char* bytes = static_cast<const unsigned char*>(data);
+        Piece& piece = this->memory_piece();
+        piece.bytes.insert(piece.bytes.end(), bytes, bytes + size);
+        piece.size += size;
+        _size += size;
+    }
+
+    void write_byte(unsigned char c) { this->write(&c, 1); }
+
+    void write_uleb128(uint64_t u) {
+        unsigned char bytes[10];
+        size_t length = 0;
+        do {
+            unsigned char c = u & 0x7F;
+            u >>= 7;
+            if (u)
+                c |= 0x80;
+            bytes[length++] = c;
+        } while (u);
+        this->write(bytes, length);
+    }
+
+    // Pad with zeros until the file offset is a multiple of 'alignment'.
+    //  Returns the number of bytes added.
+    long align(long alignment) {
+        long extra = _size % alignment;
+        if (extra == 0)
+            return 0;
+        std::vector<unsigned char> padding (alignment - extra);
+        this->write(&padding[0], padding.size());
+        return alignment - extra;
+    }
+
+    // Append a range of a cache file.
+    void copy_from_input(const DataFile& file, off_t src_offset, size_t size) {
+        const unsigned char* src_data = file.data() + src_offset;
+        if (size < min_copy_size) {
+            this->write(src_data, size);
+            return;
+        }
+        Piece piece;
+        piece.offset = _size;
+        piece.size = size;
+        piece.src_data = src_data;
+        piece.src_fd = file.fd();
+        piece.src_offset = src_offset;
+        _pieces.push_back(piece);
+        _size += size;
+    }
+
+    // Overwrite the already-written bytes at the file offset. Out-of-range
+    //  writes are ignored.
+    bool write_at(long offset, const void* data, size_t size) {
+        if (offset < 0 || offset + static_cast<long>(size) > _size)
+            return false;
+
+        const unsigned char* bytes = static_cast<const unsigned char*>(data);
+        for (std::deque<Piece>::iterator it = _pieces.begin(); size > 0 && it != _pieces.end(); ++ it) {
+            long piece_end = it->offset + static_cast<long>(it->size);
+            if (offset >= piece_end)
+                continue;
+            size_t chunk = std::min(size, static_cast<size_t>(piece_end - offset));
+            if (it->src_data) {
+                Patch patch = {offset, chunk, _patch_data.size()};
+                _patch_data.insert(_patch_data.end(), bytes, bytes + chunk);
+                _patches.push_back(patch);
+            } else {
+                memcpy(&it->bytes[offset - it->offset], bytes, chunk);
+            }
+            offset += chunk;
+            bytes += chunk;
+            size -= chunk;
+        }
+        return true;
+    }
+
+    template <typename T>
+    bool patch_at(long offset, const T& value) {
+        return this->write_at(offset, &value, sizeof(value));
+    }
+
+    // Write everything to 'file'.
+    bool flush(MappedOutputFile& file) const {
+        if (!file.reserve(file.tell() + _size))
+            return false;
+
+        BOOST_FOREACH(const Piece& piece, _pieces) {
+            bool success;
+            if (piece.src_data)
+                success = copy_input_range(file, piece.src_fd, piece.src_data, piece.src_offset, piece.size);
+            else
+                success = file.write(piece.size ? &piece.bytes[0] : NULL, piece.size);
+            if (!success)
+                return false;
+        }
+
+        // Apply the patches in the order they were made, so later ones win.
+        BOOST_FOREACH(const Patch& patch, _patches) {
+            if (!file.write_at(patch.offset, &_patch_data[patch.data_index], patch.size))
+                return false;
+        }
+        return true;
+    }
+};
+
 static boost::filesystem::path remove_all_extensions(const char* the_path) {
     boost::filesystem::path retval (the_path);
     do {
@@ -417,10 +666,677 @@ static boost::filesystem::path remove_all_extensions(const char* the_path) {
     return retval;
 }
 
+// A fast non-cryptographic checksum, mixing in a 64-bit word at a time.
+//  Chain calls by passing the previous result as 'seed'.
+static uint64_t checksum_of(const void* data, size_t size, uint64_t seed = 0xcbf29ce484222325ull) {
+    const unsigned char* p = static_cast<const unsigned char*>(data);
+    uint64_t h = seed;
+    for (; size >= 8; p += 8, size -= 8) {
+        uint64_t word;
+        memcpy(&word, p, 8);
+        h = (h ^ word) * 0x100000001b3ull;
+        h ^= h >> 32;
+    }
+    for (; size > 0; ++ p, -- size)
+        h = (h ^ *p) * 0x100000001b3ull;
+    return h;
+}
+
+// The record of the images extracted into an output folder, so that a rerun
+//  on the same cache can keep those which are still intact. An image is
+//  appended as soon as its file is completely written, so an interrupted run
+//  resumes where it stopped. An image without an entry, or whose file does not
+//  match its entry any more, is extracted again. Files are matched by size and
+//  modification time, so neither writing nor checking them reads them back.
+class Manifest {
+public:
+    struct Entry {
+        std::string uuid;
+        uint64_t size;
+        int64_t mtime;
+    };
+
+private:
+    FILE* _log;
+    boost::unordered_map<std::string, Entry> _entries;  // keyed by image path
+    pthread_mutex_t _lock;
+
+    Manifest(const Manifest&);
+    Manifest& operator=(const Manifest&);
+
+    void write_entry(const std::string& image_path, const Entry& entry) {
+        fprintf(_log, "%lld %llu %s %s\n", static_cast<long long>(entry.mtime),
+                static_cast<unsigned long long>(entry.size), entry.uuid.empty() ? "-" : entry.uuid.c_str(), image_path.c_str());
+    }
+
+    // Get the size and modification time of the regular file 'filename'.
+    static bool stat_file(const boost::filesystem::path& filename, Entry* entry) {
+        boost::system::error_code ec;
+        if (!boost::filesystem::is_regular_file(boost::filesystem::symlink_status(filename, ec)))
+            return false;
+        entry->size = boost::filesystem::file_size(filename, ec);
+        if (ec)
+            return false;
+        entry->mtime = boost::filesystem::last_write_time(filename, ec);
+        return !ec;
+    }
+
+public:
+    Manifest() : _log(NULL) { pthread_mutex_init(&_lock, NULL); }
+
+    ~Manifest() {
+        if (_log)
+            fclose(_log);
+        pthread_mutex_destroy(&_lock);
+    }
 
+    // Read the manifest of 'folder' if it was made from the cache 'cache_id',
+    //  and start a fresh one with the entries read.
+    void open(const boost::filesystem::path& folder, const std::string& cache_id) {
+        boost::filesystem::path path = folder / ".dyld_decache_manifest";
+        _entries.clear();
+        if (FILE* f = fopen(path.c_str(), "r")) {
+            char line[4096];
+            bool same_cache = fgets(line, sizeof(line), f) && line == "dyld_decache manifest 2 " + cache_id + "\n";
+            while (same_cache && fgets(line, sizeof(line), f)) {
+                long long mtime;
+                unsigned long long size;
+                char uuid[40];
+                int path_start = 0;
+                size_t length = strlen(line);
+                // A torn last line is ignored.
+                if (length == 0 || line[length-1] != '\n')
+                    break;
+                line[length-1] = '\0';
+                if (sscanf(line, "%lld %llu %39s %n", &mtime, &size, uuid, &path_start) < 3 || path_start == 0)
+                    continue;
+                Entry entry = {strcmp(uuid, "-") ? uuid : "", size, mtime};
+                _entries[line + path_start] = entry;
+            }
+            fclose(f);
+        }
+
+        boost::filesystem::create_directories(folder);
+        boost::filesystem::path temp_path = folder / ".dyld_decache_manifest.tmp";
+        _log = fopen(temp_path.c_str(), "w");
+        if (!_log) {
+            fprintf(stderr, "Warning: Cannot write the manifest '%s'.\n", path.c_str());
+            return;
+        }
+        fprintf(_log, "dyld_decache manifest 2 %s\n", cache_id.c_str());
+        typedef boost::unordered_map<std::string, Entry>::value_type Item;
+        BOOST_FOREACH(const Item& item, _entries)
+            this->write_entry(item.first, item.second);
+        fflush(_log);
+        boost::system::error_code ec;
+        boost::filesystem::rename(temp_path, path, ec);
+    }
+
+    // Check if 'filename' still holds the image at 'image_path' with the
+    //  given UUID, as recorded.
+    bool is_intact(const char* image_path, const std::string& uuid, const boost::filesystem::path& filename) const {
+        boost::unordered_map<std::string, Entry>::const_iterator it = _entries.find(image_path);
+        if (it == _entries.end() || it->second.uuid != uuid)
+            return false;
+
+        Entry current;
+        if (!stat_file(filename, &current))
+            return false;
+        return current.size != 0 && current.size == it->second.size && current.mtime == it->second.mtime;
+    }
+
+    // Record that 'filename' now completely holds the image at 'image_path'
+    //  with the given UUID. May be called from any thread.
+    void record(const char* image_path, const std::string& uuid, const boost::filesystem::path& filename) {
+        Entry entry;
+        entry.uuid = uuid;
+        if (!_log || !stat_file(filename, &entry))
+            return;
+        pthread_mutex_lock(&_lock);
+        this->write_entry(image_path, entry);
+        fflush(_log);
+        pthread_mutex_unlock(&_lock);
+    }
+};
 
 class ProgramContext;
 
+// A mutex which can be a member of a copyable object. A copy gets a mutex of
+//  its own, which is unlocked.
+class Mutex {
+private:
+    pthread_mutex_t _mutex;
+
+public:
+    Mutex() { pthread_mutex_init(&_mutex, NULL); }
+    Mutex(const Mutex&) { pthread_mutex_init(&_mutex, NULL); }
+    Mutex& operator=(const Mutex&) { return *this; }
+    ~Mutex() { pthread_mutex_destroy(&_mutex); }
+
+    void lock() { pthread_mutex_lock(&_mutex); }
+    void unlock() { pthread_mutex_unlock(&_mutex); }
+};
+
+// An append-only pool of NUL-terminated strings. The strings are referred to by
+//  their offset in the pool, so the pool can be grown and copied freely.
+class StringPool {
+    std::vector<char> _chars;
+
+public:
+    uint32_t add(const char* string, size_t length) {
+        uint32_t offset = static_cast<uint32_t>(_chars.size());
+        _chars.insert(_chars.end(), string, string + length);
+        _chars.push_back('\0');
+        return offset;
+    }
+
+    const char* at(uint32_t offset) const { return &_chars[offset]; }
+    size_t size() const { return _chars.size(); }
+};
+
+// Builds a symbol string table the way the linker does: equal strings are
+//  stored once, and a string that is the tail of another one points into it.
+//  Offset 0 is always the empty string.
+class StringTableBuilder {
+    struct Key {
+        const char* string;
+        size_t length;
+        uint32_t id;
+    };
+
+    // Compares the strings backwards, so tails sort right before the strings
+    //  ending with them.
+    struct ReversedOrder {
+        bool operator()(const Key& a, const Key& b) const {
+            const char* x = a.string + a.length;
+            const char* y = b.string + b.length;
+            while (x != a.string && y != b.string) {
+                unsigned char cx = *--x, cy = *--y;
+                if (cx != cy)
+                    return cx < cy;
+            }
+            return a.length < b.length;
+        }
+    };
+
+    std::vector<Key> _keys;
+    std::vector<uint32_t> _offsets;
+    std::vector<char> _chars;
+
+public:
+    // Add a string, which must stay alive until build(). Returns its ID.
+    uint32_t add(const char* string) {
+        Key key = {string, strlen(string), static_cast<uint32_t>(_keys.size())};
+        _keys.push_back(key);
+        return key.id;
+    }
+
+    void build() {
+        _offsets.assign(_keys.size(), 0);
+        _chars.assign(1, '\0');
+        std::sort(_keys.begin(), _keys.end(), ReversedOrder());
+
+        // Going from the back, the last string written ends with the current
+        //  one whenever any string does.
+        const Key* last = NULL;
+        uint32_t last_offset = 0;
+        BOOST_REVERSE_FOREACH(const Key& key, _keys) {
+            if (key.length == 0)
+                continue;
+            if (last && last->length >= key.length && !memcmp(last->string + last->length - key.length, key.string, key.length)) {
+                _offsets[key.id] = static_cast<uint32_t>(last_offset + last->length - key.length);
+            } else {
+                last = &key;
+                last_offset = static_cast<uint32_t>(_chars.size());
+                _offsets[key.id] = last_offset;
+                _chars.insert(_chars.end(), key.string, key.string + key.length + 1);
+            }
+        }
+    }
+
+    uint32_t offset_of(uint32_t id) const { return _offsets[id]; }
+    const char* data() const { return &_chars[0]; }
+    size_t size() const { return _chars.size(); }
+};
+
+// A hash table numbering the distinct keys 0, 1, 2, ... in the order they are
+//  first seen. It uses open addressing with linear probing in a single array,
+//  so adding a key does not allocate unless the table grows.
+template <typename K>
+class FlatIndex {
+    struct Slot {
+        K key;
+        uint32_t index;
+    };
+
+    static const uint32_t empty = ~0u;
+
+    std::vector<Slot> _slots;
+    uint32_t _count;
+
+    static uint64_t key_bits(const char* key) { return reinterpret_cast<uintptr_t>(key); }
+    static uint64_t key_bits(uint64_t key) { return key; }
+
+    size_t slot_of(K key) const {
+        size_t mask = _slots.size() - 1;
+        size_t i = static_cast<size_t>((key_bits(key) * 0x9e3779b97f4a7c15ull) >> 32) & mask;
+        while (_slots[i].index != empty && _slots[i].key != key)
+            i = (i + 1) & mask;
+        return i;
+    }
+
+    void grow() {
+        std::vector<Slot> old_slots (_slots.empty() ? 64 : 2 * _slots.size());
+        old_slots.swap(_slots);
+        BOOST_FOREACH(Slot& slot, _slots)
+            slot.index = empty;
+        BOOST_FOREACH(const Slot& slot, old_slots) {
+            if (slot.index != empty)
+                _slots[this->slot_of(slot.key)] = slot;
+        }
+    }
+
+public:
+    FlatIndex() : _count(0) {}
+
+    // Get the number of 'key', giving it the next number if it is new.
+    uint32_t index_of(K key, bool* p_added) {
+        if (2 * (_count + 1) > _slots.size())
+            this->grow();
+        Slot& slot = _slots[this->slot_of(key)];
+        *p_added = (slot.index == empty);
+        if (*p_added) {
+            slot.key = key;
+            slot.index = _count ++;
+        }
+        return slot.index;
+    }
+
+    bool contains(K key) const {
+        return _count != 0 && _slots[this->slot_of(key)].index != empty;
+    }
+
+    // Get the number of 'key', or ~0u if it has not been added.
+    uint32_t find(K key) const {
+        return _count != 0 ? _slots[this->slot_of(key)].index : empty;
+    }
+
+    uint32_t size() const { return _count; }
+};
+
+// The strings which the cache coalesced out of the images referring to them,
+//  e.g. selector names, by VM address. It is filled once for the whole cache
+//  before the images are extracted, and only read afterwards.
+class CoalescedStringIndex {
+public:
+    struct Entry {
+        const char* string;
+        size_t size;    // including the terminating NUL.
+    };
+
+private:
+    FlatIndex<uint64_t> _indices;
+    std::vector<Entry> _entries;
+
+public:
+    void add(uint64_t vmaddr, const char* string) {
+        bool added;
+        _indices.index_of(vmaddr, &added);
+        if (added) {
+            Entry entry = {string, strlen(string) + 1};
+            _entries.push_back(entry);
+        }
+    }
+
+    // Returns NULL if the address is not in the index.
+    const Entry* find(uint64_t vmaddr) const {
+        uint32_t index = _indices.find(vmaddr);
+        return index != ~0u ? &_entries[index] : NULL;
+    }
+
+    size_t size() const { return _entries.size(); }
+};
+
+// The Objective-C classes and metaclasses of the whole cache by VM address,
+//  each with the image defining it and its exported symbol, so that a
+//  reference from another image is resolved in O(1). Like the index above, it
+//  is filled once before the images are extracted, and only read afterwards.
+class ObjCSymbolIndex {
+public:
+    struct Entry {
+        uint32_t image_index;
+        const char* symname;    // owned by the image, the empty string if not exported.
+    };
+
+private:
+    FlatIndex<uint64_t> _indices;
+    std::vector<Entry> _entries;
+
+public:
+    // Add an entry, unless there is one at the same address already.
+    void add(uint64_t vmaddr, const Entry& entry) {
+        bool added;
+        _indices.index_of(vmaddr, &added);
+        if (added)
+            _entries.push_back(entry);
+    }
+
+    // Returns NULL if nothing is indexed at the address.
+    const Entry* find(uint64_t vmaddr) const {
+        uint32_t index = _indices.find(vmaddr);
+        return index != ~0u ? &_entries[index] : NULL;
+    }
+
+    size_t size() const { return _entries.size(); }
+};
+
+// Decodes an export trie iteratively, with an explicit stack and a single
+//  buffer for the symbol name being built.
+class ExportTrie {
+    struct Frame {
+        off_t next_child;
+        unsigned remaining_children;
+        size_t prefix_length;
+    };
+
+    DataCursor _trie;
+
+public:
+    ExportTrie(const DataCursor& trie) : _trie(trie) {}
+
+    // Call visitor(name, name_length, flags, address) for every exported
+    //  symbol, in depth-first order. The name is only valid during the call.
+    //  The address is relative to the image base.
+    template <typename Visitor>
+    void foreach_symbol(Visitor& visitor) const {
+        std::vector<Frame> stack;
+        std::string prefix;
+        off_t node_offset = 0;
+
+        while (true) {
+            if (node_offset < _trie.size()) {
+                DataCursor node = _trie;
+                node.seek(node_offset);
+                bool truncated;
+                unsigned term_size = node.read_uleb128<unsigned>(&truncated);
+                if (truncated)
+                    return;
+                off_t children_offset = node.tell() + term_size;
+                if (term_size != 0) {
+                    unsigned flags = node.read_uleb128<unsigned>();
+                    uint64_t address = node.read_uleb128<uint64_t>(&truncated);
+                    if (truncated)
+                        return;
+                    visitor(prefix.c_str(), prefix.size(), flags, address);
+                }
+                if (children_offset < _trie.size()) {
+                    node.seek(children_offset);
+                    Frame frame = {0, static_cast<unsigned char>(node.read_char()), prefix.size()};
+                    frame.next_child = node.tell();
+                    stack.push_back(frame);
+                    // a malformed trie may contain cycles.
+                    if (static_cast<off_t>(stack.size()) > _trie.size())
+                        return;
+                }
+            }
+
+            while (!stack.empty() && stack.back().remaining_children == 0)
+                stack.pop_back();
+            if (stack.empty())
+                return;
+
+            Frame& frame = stack.back();
+            DataCursor edge = _trie;
+            edge.seek(frame.next_child);
+            size_t suffix_length;
+            const char* suffix = edge.read_string(&suffix_length);
+            bool truncated;
+            node_offset = edge.read_uleb128<unsigned>(&truncated);
+            if (truncated)
+                return;
+            frame.next_child = edge.tell();
+            -- frame.remaining_children;
+
+            prefix.resize(frame.prefix_length);
+            prefix.append(suffix, suffix_length);
+        }
+    }
+
+    // Collect the address-to-name map of the exported symbols. The names are
+    //  stored in 'names'. If an address is exported more than once, the first
+    //  name is kept.
+    void fill_map(uint64_t bias, boost::unordered_map<uint64_t, uint32_t>& exports, StringPool& names) const {
+        MapBuilder builder = {bias, &exports, &names};
+        this->foreach_symbol(builder);
+    }
+
+private:
+    struct MapBuilder {
+        uint64_t bias;
+        boost::unordered_map<uint64_t, uint32_t>* exports;
+        StringPool* names;
+
+        void operator()(const char* name, size_t length, unsigned, uint64_t address) {
+            boost::unordered_map<uint64_t, uint32_t>::iterator it = exports->find(address + bias);
+            if (it == exports->end())
+                exports->insert(std::make_pair(address + bias, names->add(name, length)));
+        }
+    };
+};
+
+// Translates a number (an address or a file offset) by a constant which
+//  depends on the range it is in. The ranges are flattened into a sorted list
+//  of disjoint intervals, so each lookup is a binary search. Where ranges
+//  overlap, the one added first applies.
+class RangeTranslation {
+    struct Interval {
+        uint64_t begin, end;
+        int64_t delta;
+
+        bool operator<(const Interval& other) const { return begin < other.begin; }
+    };
+
+    std::vector<Interval> _intervals;
+    std::vector<Interval> _pending;
+
+public:
+    // Translate [begin, end) to [begin+delta, end+delta).
+    void add(uint64_t begin, uint64_t end, int64_t delta) {
+        if (begin >= end)
+            return;
+        Interval iv = {begin, end, delta};
+        _pending.push_back(iv);
+    }
+
+    // There are only a few ranges (one or two per segment), so each piece
+    //  between two consecutive boundaries is simply matched against them all.
+    void build() {
+        std::vector<uint64_t> bounds;
+        BOOST_FOREACH(const Interval& iv, _pending) {
+            bounds.push_back(iv.begin);
+            bounds.push_back(iv.end);
+        }
+        std::sort(bounds.begin(), bounds.end());
+        bounds.erase(std::unique(bounds.begin(), bounds.end()), bounds.end());
+
+        _intervals.clear();
+        for (size_t k = 0; k + 1 < bounds.size(); ++ k) {
+            BOOST_FOREACH(const Interval& iv, _pending) {
+                if (iv.begin <= bounds[k] && bounds[k] < iv.end) {
+                    if (!_intervals.empty() && _intervals.back().end == bounds[k] && _intervals.back().delta == iv.delta) {
+                        _intervals.back().end = bounds[k+1];
+                    } else {
+                        Interval piece = {bounds[k], bounds[k+1], iv.delta};
+                        _intervals.push_back(piece);
+                    }
+                    break;
+                }
+            }
+        }
+        _pending.clear();
+    }
+
+    // Returns false if 'x' is in none of the ranges.
+    bool translate(uint64_t x, uint64_t* p_result) const {
+        Interval key = {x, x, 0};
+        std::vector<Interval>::const_iterator it = std::upper_bound(_intervals.begin(), _intervals.end(), key);
+        if (it == _intervals.begin())
+            return false;
+        -- it;
+        if (x >= it->end)
+            return false;
+        *p_result = x + it->delta;
+        return true;
+    }
+};
+
+// Check if the pointer lies in none of the ranges [begin, begin+size).
+template <typename P>
+static bool is_outside(P ptr, const std::vector<std::pair<P, P> >& ranges) {
+    for (size_t r = 0; r < ranges.size(); ++ r) {
+        if (static_cast<P>(ptr - ranges[r].first) < ranges[r].second)
+            return false;
+    }
+    return true;
+}
+
+// Find the pointers lying in none of the ranges [begin, begin+size), and add
+//  their indices to 'outliers' in order.
+template <typename P>
+static void find_pointers_outside(const P* ptrs, size_t count, const std::vector<std::pair<P, P> >& ranges, std::vector<size_t>* outliers) {
+    for (size_t i = 0; i < count; ++ i) {
+        if (is_outside(ptrs[i], ranges))
+            outliers->push_back(i);
+    }
+}
+
+#if defined(__SSE2__)
+// The same for 32-bit pointers, checking 16 at a time against every range
+//  without branches. References from an image mostly point into the image
+//  itself, so only a block with an outlier is looked into. SSE2 only compares
+//  signed integers, so both sides are biased by 2^31.
+static void find_pointers_outside(const uint32_t* ptrs, size_t count, const std::vector<std::pair<uint32_t, uint32_t> >& ranges, std::vector<size_t>* outliers) {
+    const __m128i bias = _mm_set1_epi32(static_cast<int>(0x80000000u));
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        const __m128i* block = reinterpret_cast<const __m128i*>(ptrs + i);
+        __m128i p0 = _mm_loadu_si128(block), p1 = _mm_loadu_si128(block + 1);
+        __m128i p2 = _mm_loadu_si128(block + 2), p3 = _mm_loadu_si128(block + 3);
+        __m128i in0 = _mm_setzero_si128(), in1 = in0, in2 = in0, in3 = in0;
+        for (size_t r = 0; r < ranges.size(); ++ r) {
+            __m128i begin = _mm_set1_epi32(static_cast<int>(ranges[r].first));
+            __m128i size = _mm_set1_epi32(static_cast<int>(ranges[r].second ^ 0x80000000u));
+            in0 = _mm_or_si128(in0, _mm_cmplt_epi32(_mm_xor_si128(_mm_sub_epi32(p0, begin), bias), size));
+            in1 = _mm_or_si128(in1, _mm_cmplt_epi32(_mm_xor_si128(_mm_sub_epi32(p1, begin), bias), size));
+            in2 = _mm_or_si128(in2, _mm_cmplt_epi32(_mm_xor_si128(_mm_sub_epi32(p2, begin), bias), size));
+            in3 = _mm_or_si128(in3, _mm_cmplt_epi32(_mm_xor_si128(_mm_sub_epi32(p3, begin), bias), size));
+        }
+        unsigned inside = static_cast<unsigned>(_mm_movemask_ps(_mm_castsi128_ps(in0)))
+                        | static_cast<unsigned>(_mm_movemask_ps(_mm_castsi128_ps(in1))) << 4
+                        | static_cast<unsigned>(_mm_movemask_ps(_mm_castsi128_ps(in2))) << 8
+                        | static_cast<unsigned>(_mm_movemask_ps(_mm_castsi128_ps(in3))) << 12;
+        for (unsigned outside = ~inside & 0xFFFF, k = 0; outside; outside >>= 1, ++ k) {
+            if (outside & 1)
+                outliers->push_back(i + k);
+        }
+    }
+    for (; i < count; ++ i) {
+        if (is_outside(ptrs[i], ranges))
+            outliers->push_back(i);
+    }
+}
+#endif
+
+// A cache-wide table of the segments of every image, sorted by VM address, to
+//  find the image containing an address in O(log n). The ranges are kept
+//  disjoint: where segments of different images overlap (e.g. the __LINKEDIT
+//  segment is shared by everyone), the range belongs to the first image added,
+//  and it is marked as 'shared'.
+class SegmentIndex {
+public:
+    struct Interval {
+        uint64_t begin, end;
+        const void* header;
+        uint32_t image_index;
+        int segnum;
+        uint64_t segment_vmaddr;
+        bool shared;
+
+        bool operator<(const Interval& other) const { return begin < other.begin; }
+    };
+
+private:
+    std::vector<Interval> _intervals;
+    std::vector<Interval> _pending;
+
+public:
+    // Add a segment. Segments should be added in the order of priority.
+    template <typename SegmentCommand>
+    void add(const void* header, uint32_t image_index, int segnum, const SegmentCommand* segcmd) {
+        if (segcmd->vmsize == 0)
+            return;
+        Interval iv = {segcmd->vmaddr, static_cast<uint64_t>(segcmd->vmaddr) + segcmd->vmsize, header, image_index, segnum, segcmd->vmaddr, false};
+        _pending.push_back(iv);
+    }
+
+    // Sort all added segments and split them into disjoint ranges.
+    void build() {
+        std::map<uint64_t, Interval> pieces;
+        typedef std::map<uint64_t, Interval>::iterator It;
+
+        BOOST_FOREACH(const Interval& iv, _pending) {
+            It it = pieces.upper_bound(iv.begin);
+            if (it != pieces.begin()) {
+                It prev = it;
+                -- prev;
+                if (prev->second.end > iv.begin)
+                    it = prev;
+            }
+
+            uint64_t cursor = iv.begin;
+            std::vector<Interval> gaps;
+            for (; it != pieces.end() && it->second.begin < iv.end; ++ it) {
+                if (it->second.header != iv.header)
+                    it->second.shared = true;
+                if (cursor < it->second.begin) {
+                    Interval gap = iv;
+                    gap.begin = cursor;
+                    gap.end = it->second.begin;
+                    gaps.push_back(gap);
+                }
+                cursor = std::max(cursor, it->second.end);
+            }
+            if (cursor < iv.end) {
+                Interval gap = iv;
+                gap.begin = cursor;
+                gaps.push_back(gap);
+            }
+            BOOST_FOREACH(const Interval& gap, gaps)
+                pieces.insert(std::make_pair(gap.begin, gap));
+        }
+
+        _intervals.clear();
+        _intervals.reserve(pieces.size());
+        for (It it = pieces.begin(); it != pieces.end(); ++ it)
+            _intervals.push_back(it->second);
+        std::vector<Interval>().swap(_pending);
+    }
+
+    // Find the range containing the VM address, or NULL if no image contains
+    //  it.
+    const Interval* find(uint64_t vmaddr) const {
+        Interval key;
+        key.begin = vmaddr;
+        std::vector<Interval>::const_iterator it = std::upper_bound(_intervals.begin(), _intervals.end(), key);
+        if (it == _intervals.begin())
+            return NULL;
+        -- it;
+        if (vmaddr < it->end)
+            return &*it;
+        return NULL;
+    }
+};
+
 // When dyld create the cache file, if it recognize common Objective-C strings
 //  and methods across different libraries, they will be coalesced. However,
 //  this poses a big trouble when decaching, because the references to the other
@@ -428,19 +1344,28 @@ class ProgramContext;
 //  external references, and put them back in an extra section of the decached
 //  library.
 // ("String" is a misnomer because it can also store non-strings.)
+template <typename A>
 class ExtraStringRepository {
+    typedef typename A::pointer_t pointer_t;
+
     struct Entry {
         const char* string;
         size_t size;
-        uint32_t new_address;
-        std::vector<uint32_t> override_addresses;
+        pointer_t new_address;
+    };
+
+    struct Override {
+        uint32_t entry;
+        pointer_t address;
     };
 
-    boost::unordered_map<const char*, int> _indices;
+    FlatIndex<const char*> _indices;
     std::vector<Entry> _entries;
-    size_t _total_size;
+    // The references to the entries, in the order they were inserted. They
+    //  are grouped by entry only when iterated.
+    std::vector<Override> _overrides;
 
-    section _template;
+    typename A::section_t _template;
 
 public:
     ExtraStringRepository(const char* segname, const char* sectname, uint32_t flags, uint32_t alignment) {
@@ -453,31 +1378,40 @@ public:
 
     // Insert a piece of external data referred from 'override_address' to the
     //  repository.
-    void insert(const char* string, size_t size, uint32_t override_address) {
-        boost::unordered_map<const char*, int>::const_iterator it = _indices.find(string);
-        if (it != _indices.end()) {
-            _entries[it->second].override_addresses.push_back(override_address);
-        } else {
-            Entry entry;
-            entry.string = string;
-            entry.size = size;
-            entry.new_address = this->next_vmaddr();
-            entry.override_addresses.push_back(override_address);
-            _indices.insert(std::make_pair(string, _entries.size()));
+    void insert(const char* string, size_t size, pointer_t override_address) {
+        bool added;
+        uint32_t index = _indices.index_of(string, &added);
+        if (added) {
+            Entry entry = {string, size, this->next_vmaddr()};
             _entries.push_back(entry);
             _template.size += size;
         }
+        Override override = {index, override_address};
+        _overrides.push_back(override);
     }
 
-    void insert(const char* string, uint32_t override_address) {
+    void insert(const char* string, pointer_t override_address) {
         this->insert(string, strlen(string) + 1, override_address);
     }
 
-    // Iterate over all external data in this repository.
+    // Iterate over all external data in this repository. The addresses
+    //  referring to an entry are passed as one contiguous range.
     template <typename Object>
-    void foreach_entry(const Object* self, void (Object::*action)(const char* string, size_t size, uint32_t new_address, const std::vector<uint32_t>& override_addresses) const) const {
-        BOOST_FOREACH(const Entry& e, _entries) {
-            (self->*action)(e.string, e.size, e.new_address, e.override_addresses);
+    void foreach_entry(Object* self, void (Object::*action)(const char* string, size_t size, pointer_t new_address, const pointer_t* override_addresses, size_t override_count)) const {
+        std::vector<uint32_t> starts (_entries.size() + 1);
+        BOOST_FOREACH(const Override& o, _overrides)
+            ++ starts[o.entry + 1];
+        for (size_t i = 1; i < starts.size(); ++ i)
+            starts[i] += starts[i-1];
+
+        std::vector<pointer_t> addresses (_overrides.size());
+        std::vector<uint32_t> ends (starts.begin(), starts.end() - 1);
+        BOOST_FOREACH(const Override& o, _overrides)
+            addresses[ends[o.entry] ++] = o.address;
+
+        for (size_t i = 0; i < _entries.size(); ++ i) {
+            const Entry& e = _entries[i];
+            (self->*action)(e.string, e.size, e.new_address, &addresses[0] + starts[i], starts[i+1] - starts[i]);
         }
     }
 
@@ -487,180 +1421,473 @@ public:
 
     // Get the 'section' structure for the extra section this repository
     //  represents.
-    section section_template() const { return _template; }
+    typename A::section_t section_template() const { return _template; }
 
-    void set_section_vmaddr(uint32_t vmaddr) { _template.addr = vmaddr; }
+    void set_section_vmaddr(pointer_t vmaddr) { _template.addr = vmaddr; }
     void set_section_fileoff(uint32_t fileoff) { _template.offset = fileoff; }
-    uint32_t next_vmaddr() const { return _template.addr + _template.size; }
+    pointer_t next_vmaddr() const { return _template.addr + _template.size; }
 };
 
+template <typename A>
 class ExtraBindRepository {
+    typedef typename A::pointer_t pointer_t;
+
     struct Entry {
-        std::string symname;
+        const char* symname;    // owned by the image exporting it
         int libord;
-        std::vector<std::pair<int, uint32_t> > replace_offsets;
     };
-    
-    boost::unordered_map<uint32_t, Entry> _entries;
+
+    // A location to be bound to the target of an entry. 'entry' is replaced
+    //  by the rank of its (libord, symname) group before the binds are sorted.
+    struct Bind {
+        uint32_t entry;
+        int segnum;
+        uint32_t offset;
+
+        bool operator<(const Bind& other) const {
+            if (entry != other.entry)
+                return entry < other.entry;
+            if (segnum != other.segnum)
+                return segnum < other.segnum;
+            return offset < other.offset;
+        }
+        bool operator==(const Bind& other) const {
+            return entry == other.entry && segnum == other.segnum && offset == other.offset;
+        }
+    };
+
+    // Orders the entries by library ordinal, and then by symbol name, so that
+    //  the output does not depend on the order the targets were found in.
+    struct EntryOrder {
+        const std::vector<Entry>* entries;
+
+        int compare(uint32_t a, uint32_t b) const {
+            const Entry& x = (*entries)[a];
+            const Entry& y = (*entries)[b];
+            if (x.libord != y.libord)
+                return x.libord < y.libord ? -1 : 1;
+            return strcmp(x.symname, y.symname);
+        }
+        bool operator()(uint32_t a, uint32_t b) const { return compare(a, b) < 0; }
+    };
+
+    static unsigned uleb128_size(uint64_t u) {
+        unsigned byte_count = 1;
+        while (u >>= 7)
+            ++ byte_count;
+        return byte_count;
+    }
+
+    // Size of the single opcode that binds and then skips 'gap' bytes past the
+    //  bound pointer.
+    static unsigned bind_and_skip_size(pointer_t gap) {
+        if (gap % sizeof(pointer_t) == 0 && gap / sizeof(pointer_t) < 0x10)
+            return 1;
+        return 1 + uleb128_size(gap);
+    }
+
+    // Encodes the sorted offsets of one segment as the shortest sequence of
+    //  DO_BIND* opcodes, given the address the next run of binds wants to
+    //  start at ('has_next'), or don't-care otherwise. Returns the address
+    //  after the last opcode.
+    static pointer_t write_run(OutputImage& f, const uint32_t* offsets, size_t count, bool has_next, pointer_t next_offset) {
+        // gaps[i] is the number of bytes to skip after binding offsets[i]. The
+        //  last gap is free when the next run does not depend on it.
+        std::vector<pointer_t> gaps (count);
+        for (size_t i = 0; i + 1 < count; ++ i)
+            gaps[i] = static_cast<pointer_t>(offsets[i+1] - offsets[i] - sizeof(pointer_t));
+        bool last_is_free = !has_next;
+        if (has_next)
+            gaps[count-1] = static_cast<pointer_t>(next_offset - offsets[count-1] - sizeof(pointer_t));
+
+        // repeat[i] is how many binds starting at i share the same gap.
+        std::vector<size_t> repeat (count + 1, 1);
+        for (size_t i = count - 1; i -- > 0; ) {
+            bool same = (i + 2 == count && last_is_free) || gaps[i+1] == gaps[i];
+            repeat[i] = same ? repeat[i+1] + 1 : 1;
+        }
+
+        // cost[i] is the size of the shortest encoding of binds i..count-1.
+        //  A DO_BIND_ULEB_TIMES_SKIPPING_ULEB only ever pays off for a whole
+        //  run of equal gaps, so that is the only repetition considered.
+        std::vector<size_t> cost (count + 1, 0);
+        std::vector<size_t> step (count, 1);
+        for (size_t i = count; i -- > 0; ) {
+            size_t single = (i + 1 == count && last_is_free) ? 1 : bind_and_skip_size(gaps[i]);
+            cost[i] = single + cost[i+1];
+            size_t n = repeat[i];
+            if (n >= 2) {
+                size_t times = 1 + uleb128_size(n) + uleb128_size(gaps[i]) + cost[i+n];
+                if (times < cost[i]) {
+                    cost[i] = times;
+                    step[i] = n;
+                }
+            }
+        }
+
+        pointer_t address = 0;
+        for (size_t i = 0; i < count; i += step[i]) {
+            size_t n = step[i];
+            pointer_t gap = (i + n == count && last_is_free && n == 1) ? 0 : gaps[i];
+            if (n > 1) {
+                f.write_byte(BIND_OPCODE_DO_BIND_ULEB_TIMES_SKIPPING_ULEB);
+                f.write_uleb128(n);
+                f.write_uleb128(gap);
+            } else if (gap == 0) {
+                f.write_byte(BIND_OPCODE_DO_BIND);
+            } else if (bind_and_skip_size(gap) == 1) {
+                f.write_byte(BIND_OPCODE_DO_BIND_ADD_ADDR_IMM_SCALED | (gap / sizeof(pointer_t)));
+            } else {
+                f.write_byte(BIND_OPCODE_DO_BIND_ADD_ADDR_ULEB);
+                f.write_uleb128(gap);
+            }
+            address = static_cast<pointer_t>(offsets[i+n-1] + sizeof(pointer_t) + gap);
+        }
+        return address;
+    }
+
+    FlatIndex<pointer_t> _indices;
+    std::vector<Entry> _entries;
+    std::vector<Bind> _binds;
     
 public:
-    bool contains(uint32_t target_address) const {
-        return (_entries.find(target_address) != _entries.end());
+    bool contains(pointer_t target_address) const {
+        return _indices.contains(target_address);
     }
     
     template <typename Object>
-    void insert(uint32_t target_address, std::pair<int, uint32_t> replace_offset, const Object* self, void (Object::*addr_info_getter)(uint32_t addr, std::string* p_symname, int* p_libord) const) {
-        boost::unordered_map<uint32_t, Entry>::iterator it = _entries.find(target_address);
-        if (it != _entries.end()) {
-            it->second.replace_offsets.push_back(replace_offset);
-        } else {
-            Entry entry;
-            entry.replace_offsets.push_back(replace_offset);
+    void insert(pointer_t target_address, std::pair<int, uint32_t> replace_offset, const Object* self, void (Object::*addr_info_getter)(pointer_t addr, const char** p_symname, int* p_libord) const) {
+        bool added;
+        uint32_t index = _indices.index_of(target_address, &added);
+        if (added) {
+            Entry entry = {"", 0};
             (self->*addr_info_getter)(target_address, &entry.symname, &entry.libord);
-            _entries.insert(std::make_pair(target_address, entry));
+            _entries.push_back(entry);
         }
+        Bind bind = {index, replace_offset.first, replace_offset.second};
+        _binds.push_back(bind);
     }
     
-    long optimize_and_write(FILE* f) {
-        typedef boost::unordered_map<uint32_t, Entry>::value_type V;
-        typedef boost::unordered_map<int, std::vector<const Entry*> > M;
-        typedef std::pair<int, uint32_t> P;
-        
-        M entries_by_libord;
-        
-        BOOST_FOREACH(V& pair, _entries) {
-            Entry& entry = pair.second;
-            std::sort(entry.replace_offsets.begin(), entry.replace_offsets.end());
-            entries_by_libord[entry.libord].push_back(&entry);
-        }
-        
-        fputc(BIND_OPCODE_SET_TYPE_IMM | 1, f);
-        
-        long size = 1;
-        BOOST_FOREACH(const M::value_type& pair, entries_by_libord) {
-            int libord = pair.first;
-            if (libord < 0x10) {
-                unsigned char imm = libord & BIND_IMMEDIATE_MASK;
-                unsigned char opcode = libord < 0 ? BIND_OPCODE_SET_DYLIB_SPECIAL_IMM : BIND_OPCODE_SET_DYLIB_ORDINAL_IMM;
-                fputc(opcode | imm, f);
-                ++ size;
-            } else {
-                fputc(BIND_OPCODE_SET_DYLIB_ORDINAL_ULEB, f);
-                size += 1 + write_uleb128(f, libord);
+    long optimize_and_write(OutputImage& f) {
+        long start = f.tell();
+
+        // Rank the entries, merging those bound to the same symbol of the
+        //  same library.
+        std::vector<uint32_t> order (_entries.size());
+        for (uint32_t i = 0; i < order.size(); ++ i)
+            order[i] = i;
+        EntryOrder entry_order = {&_entries};
+        std::sort(order.begin(), order.end(), entry_order);
+
+        std::vector<uint32_t> rank (_entries.size());
+        std::vector<uint32_t> rank_entry;
+        for (size_t k = 0; k < order.size(); ++ k) {
+            if (k == 0 || entry_order.compare(order[k-1], order[k]) != 0)
+                rank_entry.push_back(order[k]);
+            rank[order[k]] = static_cast<uint32_t>(rank_entry.size() - 1);
+        }
+
+        BOOST_FOREACH(Bind& bind, _binds)
+            bind.entry = rank[bind.entry];
+        std::sort(_binds.begin(), _binds.end());
+        _binds.erase(std::unique(_binds.begin(), _binds.end()), _binds.end());
+
+        std::vector<uint32_t> offsets (_binds.size());
+        for (size_t i = 0; i < _binds.size(); ++ i)
+            offsets[i] = _binds[i].offset;
+
+        f.write_byte(BIND_OPCODE_SET_TYPE_IMM | 1);
+
+        const char* cur_symname = NULL;
+        int cur_libord = 0;
+        int cur_segnum = -1;
+        pointer_t cur_address = 0;
+        // Each run binds the same symbol in the same segment.
+        for (size_t i = 0, run_end; i < _binds.size(); i = run_end) {
+            const Bind& bind = _binds[i];
+            run_end = i + 1;
+            while (run_end < _binds.size() && _binds[run_end].entry == bind.entry && _binds[run_end].segnum == bind.segnum)
+                ++ run_end;
+
+            const Entry& entry = _entries[rank_entry[bind.entry]];
+            if (cur_symname == NULL || entry.libord != cur_libord) {
+                cur_libord = entry.libord;
+                if (cur_libord < 0x10) {
+                    unsigned char imm = cur_libord & BIND_IMMEDIATE_MASK;
+                    unsigned char opcode = cur_libord < 0 ? BIND_OPCODE_SET_DYLIB_SPECIAL_IMM : BIND_OPCODE_SET_DYLIB_ORDINAL_IMM;
+                    f.write_byte(opcode | imm);
+                } else {
+                    f.write_byte(BIND_OPCODE_SET_DYLIB_ORDINAL_ULEB);
+                    f.write_uleb128(cur_libord);
+                }
             }
-            
-            BOOST_FOREACH(const Entry* entry, pair.second) {
-                size_t string_len = entry->symname.size();
-                size += string_len + 2;
-                fputc(BIND_OPCODE_SET_SYMBOL_TRAILING_FLAGS_IMM, f);
-                fwrite(entry->symname.c_str(), string_len+1, 1, f);
-                
-                int segnum = -1;
-                uint32_t last_offset = 0;
-                BOOST_FOREACH(P offset, entry->replace_offsets) {
-                    if (offset.first != segnum) {
-                        segnum = offset.first;
-                        last_offset = offset.second + 4;
-                        fputc(BIND_OPCODE_SET_SEGMENT_AND_OFFSET_ULEB | segnum, f);
-                        size += 1 + write_uleb128(f, offset.second);
-                    } else {
-                        uint32_t delta = offset.second - last_offset;
-                        unsigned imm_scale = delta % 4 == 0 ? delta / 4 : ~0u;
-                        if (imm_scale == 0) {
-                            fputc(BIND_OPCODE_DO_BIND, f);
-                        } else if (imm_scale < 0x10u) {
-                            fputc(BIND_OPCODE_DO_BIND_ADD_ADDR_IMM_SCALED | imm_scale, f);
-                        } else {
-                            fputc(BIND_OPCODE_DO_BIND_ADD_ADDR_ULEB, f);
-                            size += write_uleb128(f, delta);
-                        }
-                        ++ size;
-                        last_offset = offset.second + 4;
-                    }
+
+            const char* symname = entry.symname;
+            if (cur_symname == NULL || strcmp(symname, cur_symname) != 0) {
+                cur_symname = symname;
+                f.write_byte(BIND_OPCODE_SET_SYMBOL_TRAILING_FLAGS_IMM);
+                f.write(symname, strlen(symname) + 1);
+            }
+
+            // Move to the first offset, relative to where the previous run
+            //  left off if that is shorter.
+            uint32_t first = offsets[i];
+            if (bind.segnum != cur_segnum || first != cur_address) {
+                pointer_t delta = static_cast<pointer_t>(first - cur_address);
+                if (bind.segnum == cur_segnum && uleb128_size(delta) < uleb128_size(first)) {
+                    f.write_byte(BIND_OPCODE_ADD_ADDR_ULEB);
+                    f.write_uleb128(delta);
+                } else {
+                    f.write_byte(BIND_OPCODE_SET_SEGMENT_AND_OFFSET_ULEB | bind.segnum);
+                    f.write_uleb128(first);
                 }
-                fputc(BIND_OPCODE_DO_BIND, f);
-                ++ size;
+            }
+
+            // Skip straight to the next run if it is further ahead in the
+            //  same segment.
+            bool has_next = run_end < _binds.size()
+                         && _binds[run_end].segnum == bind.segnum
+                         && offsets[run_end] >= offsets[run_end-1] + sizeof(pointer_t);
+            cur_segnum = bind.segnum;
+            cur_address = write_run(f, &offsets[i], run_end - i, has_next, has_next ? offsets[run_end] : 0);
+        }
+
+        return f.tell() - start;
+    }
+};
+
+// The load commands of an image, sorted out by type in a single pass over the
+//  header. Every phase of decaching reads the commands from here.
+template <typename A>
+struct LoadCommands {
+    typedef typename A::segment_command_t segment_command_t;
+    typedef typename A::section_t section_t;
+
+    std::vector<const load_command*> all;
+    std::vector<const segment_command_t*> segments;
+    // The sections of all segments, in order.
+    std::vector<const section_t*> sections;
+    // LC_ID_DYLIB and the LC_*_DYLIB commands, in the order of their ordinals.
+    std::vector<const dylib_command*> dylibs;
+    const symtab_command* symtab;
+    const dysymtab_command* dysymtab;
+    const dyld_info_command* dyld_info;
+    const uuid_command* uuid;
+
+    LoadCommands() : symtab(NULL), dysymtab(NULL), dyld_info(NULL), uuid(NULL) {}
+
+    void parse(const typename A::mach_header_t* header) {
+        const unsigned char* cur_cmd = reinterpret_cast<const unsigned char*>(header + 1);
+        const unsigned char* end = cur_cmd + header->sizeofcmds;
+        all.reserve(header->ncmds);
+
+        for (uint32_t i = 0; i < header->ncmds; ++ i) {
+            const load_command* cmd = reinterpret_cast<const load_command*>(cur_cmd);
+            if (end - cur_cmd < static_cast<ptrdiff_t>(sizeof(*cmd)) || cmd->cmdsize < sizeof(*cmd) || cmd->cmdsize > static_cast<size_t>(end - cur_cmd))
+                break;
+            cur_cmd += cmd->cmdsize;
+            all.push_back(cmd);
+
+            switch (cmd->cmd) {
+                default:
+                    break;
+                case A::segment_cmd: {
+                    const segment_command_t* segcmd = static_cast<const segment_command_t*>(cmd);
+                    segments.push_back(segcmd);
+                    const section_t* sects = reinterpret_cast<const section_t*>(1 + segcmd);
+                    for (uint32_t j = 0; j < segcmd->nsects; ++ j)
+                        sections.push_back(sects + j);
+                    break;
+                }
+                case LC_SYMTAB:
+                    symtab = static_cast<const symtab_command*>(cmd);
+                    break;
+                case LC_DYSYMTAB:
+                    dysymtab = static_cast<const dysymtab_command*>(cmd);
+                    break;
+                case LC_DYLD_INFO:
+                case LC_DYLD_INFO_ONLY:
+                    dyld_info = static_cast<const dyld_info_command*>(cmd);
+                    break;
+                case LC_LOAD_DYLIB:
+                case LC_ID_DYLIB:
+                case LC_LOAD_WEAK_DYLIB:
+                case LC_REEXPORT_DYLIB:
+                case LC_LAZY_LOAD_DYLIB:
+                case LC_LOAD_UPWARD_DYLIB:
+                    dylibs.push_back(static_cast<const dylib_command*>(cmd));
+                    break;
+                case LC_UUID:
+                    uuid = static_cast<const uuid_command*>(cmd);
+                    break;
             }
         }
-        
-        return size;
     }
 };
 
 // A simple structure which only provides services related to VM address.
+template <typename A>
 class MachOFile {
 protected:
-    const mach_header* _header;
+    typedef typename A::pointer_t pointer_t;
+    typedef typename A::mach_header_t mach_header_t;
+    typedef typename A::segment_command_t segment_command_t;
+    typedef typename A::section_t section_t;
+
+    const mach_header_t* _header;
     const ProgramContext* _context;
-    std::vector<const segment_command*> _segments;
-    uint32_t _image_vmaddr;
+    // Decoded once, and shared with the DecachingFile made from this file.
+    boost::shared_ptr<const LoadCommands<A> > _commands;
+    pointer_t _image_vmaddr;
 	std::string _uuid;
     
 private:
     boost::unordered_map<std::string, int> _libords;
-    int _cur_libord;
-    boost::unordered_map<uint32_t, std::string> _exports;
-
-protected:
-    template <typename T>
-    void foreach_command(void(T::*action)(const load_command* cmd)) {
-        const unsigned char* cur_cmd = reinterpret_cast<const unsigned char*>(_header + 1);
-
-        for (uint32_t i = 0; i < _header->ncmds; ++ i) {
-            const load_command* cmd = reinterpret_cast<const load_command*>(cur_cmd);
-            cur_cmd += cmd->cmdsize;
+    // The export trie is only decoded when a symbol is first asked for.
+    mutable boost::unordered_map<uint64_t, uint32_t> _exports;
+    mutable StringPool _export_names;
+    mutable bool _exports_loaded;
+    mutable Mutex _exports_lock;
 
-            (static_cast<T*>(this)->*action)(cmd);
-        }
-    }
+    void load_exports() const;
 
+protected:
     // Convert VM address to file offset of the decached file _before_ inserting
     //  the extra sections.
-    long from_vmaddr(uint32_t vmaddr) const {
-        BOOST_FOREACH(const segment_command* segcmd, _segments) {
-            if (segcmd->vmaddr <= vmaddr && vmaddr < segcmd->vmaddr + segcmd->vmsize)
-                return vmaddr - segcmd->vmaddr + segcmd->fileoff;
-        }
-        return -1;
+    long from_vmaddr(pointer_t vmaddr) const {
+        int segnum = this->segnum_containing(vmaddr);
+        if (segnum < 0)
+            return -1;
+        const segment_command_t* segcmd = _commands->segments[segnum];
+        return vmaddr - segcmd->vmaddr + segcmd->fileoff;
     }
 
-private:
-    void retrieve_segments_and_libords(const load_command* cmd);
-    void retrieve_uuid(const load_command* cmd);
+    // Get the index of the segment which contains the VM address, or -1 if it
+    //  is outside of this file.
+    int segnum_containing(pointer_t vmaddr) const;
+
+    // Find the cache file and offset of a file offset used in the load
+    //  commands. In a split cache these are relative to the file holding the
+    //  segment they fall in, so they are resolved through that segment.
+    const DataFile* locate_fileoff(uint32_t fileoff, off_t* p_offset) const;
 
 public:
     // Checks if the VM address is included in the decached file _before_
     //  inserting the extra sections.
-    bool contains_address(uint32_t vmaddr) const {
-        BOOST_FOREACH(const segment_command* segcmd, _segments) {
-            if (segcmd->vmaddr <= vmaddr && vmaddr < segcmd->vmaddr + segcmd->vmsize)
-                return true;
+    bool contains_address(pointer_t vmaddr) const {
+        return this->segnum_containing(vmaddr) >= 0;
+    }
+
+    // As contains_address() on a whole array, adding the indices of the
+    //  pointers outside of this image to 'outliers'.
+    void find_foreign_pointers(const pointer_t* ptrs, size_t count, std::vector<size_t>* outliers) const {
+        std::vector<std::pair<pointer_t, pointer_t> > ranges;
+        BOOST_FOREACH(const segment_command_t* segcmd, _commands->segments)
+            ranges.push_back(std::make_pair(segcmd->vmaddr, segcmd->vmsize));
+        find_pointers_outside(ptrs, count, ranges, outliers);
+    }
+
+    // Add the targets of the selector references which point outside of this
+    //  image, i.e. to names coalesced into another image, to 'targets'.
+    void find_foreign_selectors(const AddressSpaceView& vm, std::vector<uint64_t>* targets) const {
+        BOOST_FOREACH(const section_t* sect, _commands->sections) {
+            if (!streq(sect->segname, "__DATA") || !streq(sect->sectname, "__objc_selrefs"))
+                continue;
+            size_t count = sect->size / sizeof(pointer_t);
+            const pointer_t* refs = vm.at<pointer_t>(sect->addr, count);
+            if (!refs)
+                continue;
+            std::vector<size_t> outliers;
+            this->find_foreign_pointers(refs, count, &outliers);
+            BOOST_FOREACH(size_t j, outliers)
+                targets->push_back(refs[j]);
+        }
+    }
+
+    // Add the Objective-C classes defined by this image, and their
+    //  metaclasses, to 'symbols' with their exported symbols. These are all
+    //  that other images link to.
+    void find_objc_symbols(const AddressSpaceView& vm, uint32_t image_index, std::vector<std::pair<uint64_t, ObjCSymbolIndex::Entry> >* symbols) const {
+        BOOST_FOREACH(const section_t* sect, _commands->sections) {
+            if (!streq(sect->segname, "__DATA") || !streq(sect->sectname, "__objc_classlist"))
+                continue;
+
+            size_t count = sect->size / sizeof(pointer_t);
+            const pointer_t* list = vm.at<pointer_t>(sect->addr, count);
+            for (size_t j = 0; list && j < count; ++ j) {
+                if (!this->contains_address(list[j]))
+                    continue;
+                ObjCSymbolIndex::Entry entry = {image_index, this->exported_symbol(list[j])};
+                symbols->push_back(std::make_pair(static_cast<uint64_t>(list[j]), entry));
+
+                // The metaclass is not listed, but found through the class.
+                const class_t<pointer_t>* class_obj = vm.at<class_t<pointer_t> >(list[j]);
+                if (!class_obj || !this->contains_address(class_obj->isa))
+                    continue;
+                ObjCSymbolIndex::Entry metaentry = {image_index, this->exported_symbol(class_obj->isa)};
+                symbols->push_back(std::make_pair(static_cast<uint64_t>(class_obj->isa), metaentry));
+            }
         }
-        return false;
     }
     
-    MachOFile(const mach_header* header, const ProgramContext* context, uint32_t image_vmaddr = 0)
-        : _header(header), _context(context), _image_vmaddr(image_vmaddr), _cur_libord(0)
+    MachOFile(const mach_header_t* header, const ProgramContext* context, pointer_t image_vmaddr = 0)
+        : _header(header), _context(context), _image_vmaddr(image_vmaddr), _exports_loaded(false)
     {
+        LoadCommands<A>* commands = new LoadCommands<A>;
+        _commands.reset(commands);
+        if (_header->magic == A::magic)
+            commands->parse(_header);
 	}
 
+    // Reuse the load commands already decoded for 'image'.
+    MachOFile(const MachOFile& image, const ProgramContext* context)
+        : _header(image._header), _context(context), _commands(image._commands), _image_vmaddr(0), _exports_loaded(false) {}
+
 	void prepare_for_save()
 	{
-        if (_header->magic != 0xfeedface)
-            return;
+        int libord = 0;
+        BOOST_FOREACH(const dylib_command* dlcmd, _commands->dylibs) {
+            std::string dlname (dlcmd->dylib.name + reinterpret_cast<const char*>(dlcmd));
+            _libords.insert(std::make_pair(dlname, libord));
+            ++ libord;
+        }
+    }
 
-        this->foreach_command(&MachOFile::retrieve_segments_and_libords);
+    // Add all segments of this file to the cache-wide segment index.
+    void add_to_index(SegmentIndex& index, uint32_t image_index) const {
+        int segnum = 0;
+        BOOST_FOREACH(const segment_command_t* segcmd, _commands->segments) {
+            index.add(_header, image_index, segnum, segcmd);
+            ++ segnum;
+        }
     }
 
 	void find_uuid()
 	{
-        if (_header->magic != 0xfeedface)
+        const uuid_command* uuidcmd = _commands->uuid;
+        if (!uuidcmd)
             return;
 
-        this->foreach_command(&MachOFile::retrieve_uuid);
+        char uuid[37];
+        sprintf(uuid, "%02X%02X%02X%02X-%02X%02X-%02X%02X-%02X%02X-%02X%02X%02X%02X%02X%02X",
+                uuidcmd->byte0, uuidcmd->byte1, uuidcmd->byte2, uuidcmd->byte3,
+                uuidcmd->byte4, uuidcmd->byte5, uuidcmd->byte6, uuidcmd->byte7,
+                uuidcmd->byte8, uuidcmd->byte9, uuidcmd->byte10, uuidcmd->byte11,
+                uuidcmd->byte12, uuidcmd->byte13, uuidcmd->byte14, uuidcmd->byte15);
+        _uuid = uuid;
     }
 
-    const mach_header* header() const { return _header; }
+    const mach_header_t* header() const { return _header; }
+
+    // The number of bytes in the segments which will be copied out.
+    uint64_t content_size() const {
+        uint64_t size = 0;
+        BOOST_FOREACH(const segment_command_t* segcmd, _commands->segments) {
+            if (!streq(segcmd->segname, "__LINKEDIT"))
+                size += segcmd->filesize;
+        }
+        return size;
+    }
     
     int libord_with_name(const char* libname) const {
         boost::unordered_map<std::string, int>::const_iterator cit = _libords.find(libname); 
@@ -670,10 +1897,13 @@ public:
             return cit->second;
     }
     
-    std::string exported_symbol(uint32_t vmaddr) const {
-        boost::unordered_map<uint32_t, std::string>::const_iterator cit = _exports.find(vmaddr);
+    // The name is handed out of the pool, which is not changed any more once
+    //  loaded. Returns the empty string if nothing is exported at the address.
+    const char* exported_symbol(uint64_t vmaddr) const {
+        this->load_exports();
+        boost::unordered_map<uint64_t, uint32_t>::const_iterator cit = _exports.find(vmaddr);
         if (cit != _exports.end())
-            return cit->second;
+            return _export_names.at(cit->second);
         else
             return "";
     }
@@ -698,17 +1928,25 @@ public:
 //  5. Append the extra 'section' header to the corresponding segments, if there
 //     are external Objective-C selectors or methods.
 //  6. Go through the Objective-C sections and rewire the external references.
-class DecachingFile : public MachOFile {
-    struct FileoffFixup {
-        uint32_t sourceBegin;
-        uint32_t sourceEnd;
-        int32_t negDelta;
-    };
+// The layout of the segments is planned before anything is written, and the
+//  whole file is built in an OutputImage, so phases 4 to 6 only patch memory.
+//  The file is written out in one pass at the end.
+template <typename A>
+class DecachingFile : public MachOFile<A> {
+    typedef typename A::pointer_t pointer_t;
+    typedef typename A::mach_header_t mach_header_t;
+    typedef typename A::segment_command_t segment_command_t;
+    typedef typename A::section_t section_t;
+    typedef typename A::nlist_t nlist_t;
+
+    using MachOFile<A>::_header;
+    using MachOFile<A>::_context;
+    using MachOFile<A>::_commands;
 
     struct ObjcExtraString {
         const char* string;
         size_t entry_size;
-        uint32_t new_address;
+        pointer_t new_address;
         off_t override_offset;
     };
 
@@ -726,32 +1964,62 @@ class DecachingFile : public MachOFile {
 
 private:
     uint32_t _linkedit_offset, _linkedit_size;
-    uint32_t _imageinfo_address, _imageinfo_replacement;
-
-    FILE* _f;
-    std::vector<FileoffFixup> _fixups;
-    std::vector<segment_command> _new_segments;
-    ExtraStringRepository _extra_text, _extra_data;
-    std::vector<uint32_t> _nullify_patches;
-    ExtraBindRepository _extra_bind;
+    pointer_t _imageinfo_address;
+    uint32_t _imageinfo_replacement;
+
+    AddressSpaceView _vm;
+    MappedOutputFile* _file;
+    OutputImage _out;
+    bool _complete;
+    long _load_commands_end;
+    RangeTranslation _fileoff_fixups;   // file offsets in the cache -> in the decached file
+    std::vector<segment_command_t> _new_segments;
+    RangeTranslation _new_fileoffs;     // VM addresses -> file offsets in the decached file
+    ExtraStringRepository<A> _extra_text, _extra_data;
+    std::vector<pointer_t> _nullify_patches;
+    ExtraBindRepository<A> _extra_bind;
 
 private:
     void open_file(const boost::filesystem::path& filename) {
         boost::filesystem::create_directories(filename.parent_path());
-        _f = fopen(filename.c_str(), "wb");
-        if (!_f) {
+        try {
+            _file = new MappedOutputFile(filename.c_str());
+        } catch (const TRException&) {
             perror("Error");
             fprintf(stderr, "Error: Cannot write to '%s'.\n", filename.c_str());
         }
     }
 
-    void write_extrastr(const char* string, size_t size, uint32_t, const std::vector<uint32_t>&) const {
-        fwrite(string, size, 1, _f);
+    void flush_file();
+    void prefetch_segments() const;
+
+    // Typed views of the cache, which are NULL unless wholly mapped.
+    template <typename T>
+    const T* at_vmaddr(pointer_t vmaddr, size_t count = 1) const { return _vm.at<T>(vmaddr, count); }
+    const char* string_at_vmaddr(pointer_t vmaddr) const { return _vm.string_at(vmaddr); }
+
+    // The string to be copied into an extra section, and its size including
+    //  the NUL. Coalesced strings are taken from the cache-wide index.
+    const char* extra_string_at(pointer_t vmaddr, size_t* p_size) const {
+        const CoalescedStringIndex::Entry* entry = _context->coalesced_strings().find(vmaddr);
+        if (entry) {
+            *p_size = entry->size;
+            return entry->string;
+        }
+        const char* string = this->string_at_vmaddr(vmaddr);
+        if (string)
+            *p_size = strlen(string) + 1;
+        return string;
+    }
+
+    void write_extrastr(const char* string, size_t size, pointer_t, const pointer_t*, size_t) {
+        _out.write(string, size);
     }
 
-    void write_segment_content(const segment_command* cmd);
+    void plan_segment_layout();
+    void write_segment_content(const segment_command_t* cmd);
 
-    ExtraStringRepository* repo_for_segname(const char* segname) {
+    ExtraStringRepository<A>* repo_for_segname(const char* segname) {
         if (!strcmp(segname, "__DATA"))
             return &_extra_data;
         else if (!strcmp(segname, "__TEXT"))
@@ -760,40 +2028,41 @@ private:
     }
 
     template<typename T>
-    void fix_offset(T& fileoff) const {
-        if (fileoff == 0)
-            return;
-
-        BOOST_REVERSE_FOREACH(const FileoffFixup& fixup, _fixups) {
-            if (fixup.sourceBegin <= fileoff && fileoff < fixup.sourceEnd) {
-                fileoff -= fixup.negDelta;
-                return;
-            }
-        }
+    void fix_offset(T& fileoff) const {
+        uint64_t new_fileoff;
+        if (fileoff != 0 && _fileoff_fixups.translate(fileoff, &new_fileoff))
+            fileoff = static_cast<T>(new_fileoff);
     }
 
-    void write_real_linkedit(const load_command* cmd);
+    void write_real_linkedit();
+
+    // Store a fixed load command over the original ones, which were copied
+    //  with the first segment.
+    void write_load_command(const void* data, size_t size) {
+        _out.write_at(_load_commands_end, data, size);
+        _load_commands_end += static_cast<long>(size);
+    }
 
     void fix_file_offsets(const load_command* cmd) {
         switch (cmd->cmd) {
             default:
-                fwrite(cmd, cmd->cmdsize, 1, _f);
+                this->write_load_command(cmd, cmd->cmdsize);
                 break;
 
-            case LC_SEGMENT: {
-                segment_command segcmd = *static_cast<const segment_command*>(cmd);
+            case A::segment_cmd: {
+                segment_command_t segcmd = *static_cast<const segment_command_t*>(cmd);
                 if (streq(segcmd.segname, "__LINKEDIT")) {
                     segcmd.vmsize = _linkedit_size;
                     segcmd.fileoff = _linkedit_offset;
                     segcmd.filesize = _linkedit_size;
-                    fwrite(&segcmd, sizeof(segcmd), 1, _f);
+                    this->write_load_command(&segcmd, sizeof(segcmd));
                 } else {
-                    const ExtraStringRepository* extra_repo = this->repo_for_segname(segcmd.segname);
+                    const ExtraStringRepository<A>* extra_repo = this->repo_for_segname(segcmd.segname);
                     bool has_extra_sect = extra_repo && extra_repo->has_content();
 
                     this->fix_offset(segcmd.fileoff);
-                    section* sects = new section[segcmd.nsects + has_extra_sect];
-                    memcpy(sects, 1 + static_cast<const segment_command*>(cmd), segcmd.nsects * sizeof(*sects));
+                    section_t* sects = new section_t[segcmd.nsects + has_extra_sect];
+                    memcpy(sects, 1 + static_cast<const segment_command_t*>(cmd), segcmd.nsects * sizeof(*sects));
                     for (uint32_t i = 0; i < segcmd.nsects; ++ i) {
                         this->fix_offset(sects[i].offset);
                         this->fix_offset(sects[i].reloff);
@@ -806,8 +2075,8 @@ private:
                         segcmd.filesize += extra_sect_size;
                         segcmd.nsects += 1;
                     }
-                    fwrite(&segcmd, sizeof(segcmd), 1, _f);
-                    fwrite(sects, sizeof(*sects), segcmd.nsects, _f);
+                    this->write_load_command(&segcmd, sizeof(segcmd));
+                    this->write_load_command(sects, sizeof(*sects) * segcmd.nsects);
                     delete[] sects;
                 }
                 _new_segments.push_back(segcmd);
@@ -819,7 +2088,7 @@ private:
                 symcmd.symoff = _new_linkedit_offsets.symoff;
                 symcmd.stroff = _new_linkedit_offsets.stroff;
                 symcmd.strsize = _new_linkedit_offsets.strsize;
-                fwrite(&symcmd, sizeof(symcmd), 1, _f);
+                this->write_load_command(&symcmd, sizeof(symcmd));
                 break;
             }
 
@@ -831,33 +2100,16 @@ private:
                 dycmd.indirectsymoff = _new_linkedit_offsets.indirectsymoff;
                 dycmd.extreloff = _new_linkedit_offsets.extreloff;
                 dycmd.locreloff = _new_linkedit_offsets.locreloff;
-                fwrite(&dycmd, sizeof(dycmd), 1, _f);
+                this->write_load_command(&dycmd, sizeof(dycmd));
                 break;
             }
 
             case LC_TWOLEVEL_HINTS: {
                 twolevel_hints_command tlcmd = *static_cast<const twolevel_hints_command*>(cmd);
                 this->fix_offset(tlcmd.offset);
-                fwrite(&tlcmd, sizeof(tlcmd), 1, _f);
-                break;
-            }
-
-            /*
-            case LC_SEGMENT_64: {
-                segment_command_64 segcmd = *static_cast<const segment_command_64*>(cmd);
-                this->fix_offset(segcmd.fileoff);
-                fwrite(&segcmd, sizeof(segcmd), 1, _f);
-                section_64* sects = new section_64[segcmd.nsects];
-                memcpy(sects, 1 + static_cast<const segment_command_64*>(cmd), segcmd.nsects * sizeof(*sects));
-                for (uint32_t i = 0; i < segcmd.nsects; ++ i) {
-                    this->fix_offset(sects[i].offset);
-                    this->fix_offset(sects[i].reloff);
-                }
-                fwrite(sects, sizeof(*sects), segcmd.nsects, _f);
-                delete[] sects;
+                this->write_load_command(&tlcmd, sizeof(tlcmd));
                 break;
             }
-            */
 
             case LC_CODE_SIGNATURE:
             case LC_SEGMENT_SPLIT_INFO: 
@@ -869,14 +2121,14 @@ private:
                     ldcmd.dataoff = _new_linkedit_offsets.dataoff_ssi;
                 else if (ldcmd.cmd == LC_FUNCTION_STARTS)
                     ldcmd.dataoff = _new_linkedit_offsets.dataoff_fs;
-                fwrite(&ldcmd, sizeof(ldcmd), 1, _f);
+                this->write_load_command(&ldcmd, sizeof(ldcmd));
                 break;
             }
 
             case LC_ENCRYPTION_INFO: {
                 encryption_info_command eicmd = *static_cast<const encryption_info_command*>(cmd);
                 this->fix_offset(eicmd.cryptoff);
-                fwrite(&eicmd, sizeof(eicmd), 1, _f);
+                this->write_load_command(&eicmd, sizeof(eicmd));
                 break;
             }
 
@@ -889,145 +2141,289 @@ private:
                 dicmd.lazy_bind_off = _new_linkedit_offsets.lazy_bind_off;
                 dicmd.export_off = _new_linkedit_offsets.export_off;
                 dicmd.bind_size = _new_linkedit_offsets.bind_size;
-                fwrite(&dicmd, sizeof(dicmd), 1, _f);
+                this->write_load_command(&dicmd, sizeof(dicmd));
                 break;
             }
         }
     }
 
+    // Build the map of from_new_vmaddr() once all segments are laid out.
+    void plan_new_fileoffs() {
+        for (size_t i = 0; i < _new_segments.size(); ++ i) {
+            const segment_command_t& newseg = _new_segments[i];
+            const segment_command_t* oldseg = _commands->segments[i];
+            uint64_t begin = newseg.vmaddr;
+            uint64_t end = begin + newseg.vmsize;
+            uint64_t old_end = static_cast<uint64_t>(oldseg->vmaddr) + oldseg->vmsize;
+            int64_t delta = static_cast<int64_t>(newseg.fileoff) - static_cast<int64_t>(begin);
+            // This mess is added to solve the __DATA,__bss section issue.
+            // This section is zero-filled, causing the segment's vmsize
+            //  larger than the filesize. Since the __extradat section is
+            //  placed after the __bss section, using just the delta above
+            //  will cause the imaginary size comes from that section to be
+            //  included as well. The second range below attempts to fix it.
+            _new_fileoffs.add(begin, std::min(end, old_end), delta);
+            _new_fileoffs.add(std::max(begin, old_end), end, delta - static_cast<int64_t>(oldseg->vmsize - oldseg->filesize));
+        }
+        _new_fileoffs.build();
+    }
+
     // Convert VM address to file offset of the decached file _after_ inserting
     //  the extra sections.
-    long from_new_vmaddr(uint32_t vmaddr) const {
-        std::vector<segment_command>::const_iterator nit;
-        std::vector<const segment_command*>::const_iterator oit;
-        
-        std::vector<segment_command>::const_iterator end = _new_segments.end(); 
-        for (nit = _new_segments.begin(), oit = _segments.begin(); nit != end; ++ nit, ++ oit) {
-            if (nit->vmaddr <= vmaddr && vmaddr < nit->vmaddr + nit->vmsize) {
-                uint32_t retval = vmaddr - nit->vmaddr + nit->fileoff;
-                // This mess is added to solve the __DATA,__bss section issue.
-                // This section is zero-filled, causing the segment's vmsize
-                //  larger than the filesize. Since the __extradat section is
-                //  placed after the __bss section, using just the formula above
-                //  will cause the imaginary size comes from that section to be
-                //  included as well. The "-=" below attempts to fix it.
-                if (vmaddr >= (*oit)->vmaddr + (*oit)->vmsize)
-                    retval -= (*oit)->vmsize - (*oit)->filesize;
-                return retval;
-            }
-        }
-        
-        return -1;
+    long from_new_vmaddr(pointer_t vmaddr) const {
+        uint64_t fileoff;
+        if (!_new_fileoffs.translate(vmaddr, &fileoff))
+            return -1;
+        return static_cast<long>(static_cast<pointer_t>(fileoff));
     }
     
     // Get the segment number and offset from that segment given a VM address.
-    std::pair<int, uint32_t> segnum_and_offset(uint32_t vmaddr) const {
-        int i = 0;
-        BOOST_FOREACH(const segment_command* segcmd, _segments) {
-            if (segcmd->vmaddr <= vmaddr && vmaddr < segcmd->vmaddr + segcmd->vmsize)
-                return std::make_pair(i, vmaddr - segcmd->vmaddr);
-            ++ i;
-        }
-        return std::make_pair(-1, ~0u);
+    std::pair<int, uint32_t> segnum_and_offset(pointer_t vmaddr) const {
+        int segnum = this->segnum_containing(vmaddr);
+        if (segnum < 0)
+            return std::make_pair(-1, ~0u);
+        return std::make_pair(segnum, static_cast<uint32_t>(vmaddr - _commands->segments[segnum]->vmaddr));
     }
 
     template <typename T>
-    void prepare_patch_objc_list(uint32_t list_vmaddr, uint32_t override_vmaddr);
-    void prepare_objc_extrastr(const segment_command* segcmd);
+    void prepare_patch_objc_list(pointer_t list_vmaddr, pointer_t override_vmaddr);
+    void prepare_objc_extrastr();
 
-    void get_address_info(uint32_t vmaddr, std::string* p_name, int* p_libord) const;
-    void add_extlink_to(uint32_t vmaddr, uint32_t override_vmaddr);
+    void get_address_info(pointer_t vmaddr, const char** p_name, int* p_libord) const;
+    void add_extlink_to(pointer_t vmaddr, pointer_t override_vmaddr);
 
-    void patch_objc_sects_callback(const char*, size_t, uint32_t new_address, const std::vector<uint32_t>& override_addresses) const {
-        BOOST_FOREACH(uint32_t vmaddr, override_addresses) {
-            long actual_offset = this->from_new_vmaddr(vmaddr);
-            fseek(_f, actual_offset, SEEK_SET);
-            fwrite(&new_address, 4, 1, _f);
-        }
+    void patch_objc_sects_callback(const char*, size_t, pointer_t new_address, const pointer_t* override_addresses, size_t override_count) {
+        for (size_t i = 0; i < override_count; ++ i)
+            _out.patch_at(this->from_new_vmaddr(override_addresses[i]), new_address);
     }
 
-    void patch_objc_sects() const {
+    void patch_objc_sects() {
         _extra_text.foreach_entry(this, &DecachingFile::patch_objc_sects_callback);
         _extra_data.foreach_entry(this, &DecachingFile::patch_objc_sects_callback);
 
-        this->patch_objc_sects_callback(NULL, 0, 0, _nullify_patches);
+        BOOST_FOREACH(pointer_t vmaddr, _nullify_patches)
+            _out.patch_at(this->from_new_vmaddr(vmaddr), static_cast<pointer_t>(0));
 
-        if (_imageinfo_address) {
-            long actual_offset = this->from_new_vmaddr(_imageinfo_address);
-            fseek(_f, actual_offset, SEEK_SET);
-            fwrite(&_imageinfo_replacement, 4, 1, _f);
-        }
+        if (_imageinfo_address)
+            _out.patch_at(this->from_new_vmaddr(_imageinfo_address), _imageinfo_replacement);
     }
 
 public:
-    DecachingFile(const boost::filesystem::path& filename, const mach_header* header, const ProgramContext* context) :
-        MachOFile(header, context), _imageinfo_address(0),
+    DecachingFile(const boost::filesystem::path& filename, const MachOFile<A>& image, const ProgramContext* context) :
+        MachOFile<A>(image, context), _imageinfo_address(0), _vm(this->_context->files()), _file(NULL),
+        _complete(false),
+        _load_commands_end(sizeof(mach_header_t)),
         _extra_text("__TEXT", "__objc_extratxt", 2, 0),
         _extra_data("__DATA", "__objc_extradat", 0, 2)
     {
-        if (header->magic != 0xfeedface) {
+        if (_header->magic != A::magic) {
             fprintf(stderr,
-                "Error: Cannot dump '%s'. Only 32-bit little-endian single-file\n"
-                "       Mach-O objects are supported.\n", filename.c_str());
+                "Error: Cannot dump '%s'. Only little-endian single-file Mach-O\n"
+                "       objects of the same pointer width as the cache are supported.\n", filename.c_str());
             return;
         }
+        this->prepare_for_save();
         memset(&_new_linkedit_offsets, 0, sizeof(_new_linkedit_offsets));
 
         this->open_file(filename);
-        if (!_f)
+        if (!_file)
             return;
 
         // phase 1
-        BOOST_FOREACH(const segment_command* segcmd, _segments) {
-            ExtraStringRepository* repo = this->repo_for_segname(segcmd->segname);
+        BOOST_FOREACH(const segment_command_t* segcmd, _commands->segments) {
+            ExtraStringRepository<A>* repo = this->repo_for_segname(segcmd->segname);
             if (repo)
                 repo->set_section_vmaddr(segcmd->vmaddr + segcmd->vmsize);
         }
-        BOOST_FOREACH(const segment_command* segcmd, _segments)
-            this->prepare_objc_extrastr(segcmd);
+        this->prepare_objc_extrastr();
 
         // phase 2
-        BOOST_FOREACH(const segment_command* segcmd, _segments)
+        this->plan_segment_layout();
+        this->prefetch_segments();
+        BOOST_FOREACH(const segment_command_t* segcmd, _commands->segments)
             this->write_segment_content(segcmd);
 
         // phase 3
-        _linkedit_offset = static_cast<uint32_t>(ftell(_f));
-        this->foreach_command(&DecachingFile::write_real_linkedit);
-        _linkedit_size = static_cast<uint32_t>(ftell(_f)) - _linkedit_offset;
+        this->write_real_linkedit();
+        _linkedit_size = static_cast<uint32_t>(_out.tell()) - _linkedit_offset;
 
         // phase 4 & 5
-        fseek(_f, offsetof(mach_header, sizeofcmds), SEEK_SET);
-        uint32_t new_sizeofcmds = _header->sizeofcmds + (_extra_text.has_content() + _extra_data.has_content()) * sizeof(section);
-        fwrite(&new_sizeofcmds, sizeof(new_sizeofcmds), 1, _f);
-        fseek(_f, sizeof(*header), SEEK_SET);
-        this->foreach_command(&DecachingFile::fix_file_offsets);
+        uint32_t new_sizeofcmds = _header->sizeofcmds + (_extra_text.has_content() + _extra_data.has_content()) * sizeof(section_t);
+        _out.patch_at(offsetof(mach_header_t, sizeofcmds), new_sizeofcmds);
+        BOOST_FOREACH(const load_command* cmd, _commands->all)
+            this->fix_file_offsets(cmd);
+        this->plan_new_fileoffs();
 
         // phase 6
         this->patch_objc_sects();
+
+        this->flush_file();
     }
 
     ~DecachingFile() {
-        if (_f)
-            fclose(_f);
+        delete _file;
+    }
+
+    bool is_open() const { return _file != NULL; }
+
+    // Whether the file was written out in full.
+    bool is_complete() const { return _complete; }
+
+};
+
+// A work-stealing thread pool to decache several images at once. The jobs are
+//  dealt out to the workers largest-first. Each worker takes jobs from the
+//  front of its own queue, and when that runs dry it steals from the back of
+//  the fullest queue of the other workers.
+template <typename Object>
+class ExtractionPool {
+public:
+    struct Job {
+        uint32_t image_index;
+        uint64_t size;
+
+        bool operator<(const Job& other) const {
+            if (size != other.size)
+                return size > other.size;
+            return image_index < other.image_index;
+        }
+    };
+
+private:
+    struct Worker {
+        pthread_t thread;
+        pthread_mutex_t lock;
+        std::deque<uint32_t> queue;
+        ExtractionPool* pool;
+    };
+
+    Object* _self;
+    void (Object::*_action)(uint32_t image_index);
+    std::vector<Worker> _workers;
+
+    bool pop_own(Worker& w, uint32_t* p_image_index) {
+        bool found = false;
+        pthread_mutex_lock(&w.lock);
+        if (!w.queue.empty()) {
+            *p_image_index = w.queue.front();
+            w.queue.pop_front();
+            found = true;
+        }
+        pthread_mutex_unlock(&w.lock);
+        return found;
+    }
+
+    bool steal(const Worker& thief, uint32_t* p_image_index) {
+        while (true) {
+            Worker* victim = NULL;
+            size_t victim_size = 0;
+            BOOST_FOREACH(Worker& w, _workers) {
+                if (&w == &thief)
+                    continue;
+                pthread_mutex_lock(&w.lock);
+                size_t size = w.queue.size();
+                pthread_mutex_unlock(&w.lock);
+                if (size > victim_size) {
+                    victim = &w;
+                    victim_size = size;
+                }
+            }
+            if (!victim)
+                return false;
+
+            bool found = false;
+            pthread_mutex_lock(&victim->lock);
+            if (!victim->queue.empty()) {
+                *p_image_index = victim->queue.back();
+                victim->queue.pop_back();
+                found = true;
+            }
+            pthread_mutex_unlock(&victim->lock);
+            if (found)
+                return true;
+        }
     }
 
-    bool is_open() const { return _f != NULL; }
+    void run(Worker& w) {
+        uint32_t image_index;
+        while (this->pop_own(w, &image_index) || this->steal(w, &image_index)) {
+            // An escaping exception would terminate every worker, so report
+            //  it and carry on with the next image.
+            try {
+                (_self->*_action)(image_index);
+            } catch (const std::exception& e) {
+                fprintf(stderr, "**** Failed: %s\n", e.what());
+            }
+        }
+    }
+
+    static void* worker_main(void* arg) {
+        Worker* w = static_cast<Worker*>(arg);
+        w->pool->run(*w);
+        return NULL;
+    }
 
+public:
+    ExtractionPool(Object* self, void (Object::*action)(uint32_t image_index), unsigned thread_count)
+        : _self(self), _action(action), _workers(thread_count ? thread_count : 1) {}
+
+    void execute(std::vector<Job> jobs) {
+        std::sort(jobs.begin(), jobs.end());
+        size_t worker_count = _workers.size();
+        for (size_t i = 0; i < jobs.size(); ++ i)
+            _workers[i % worker_count].queue.push_back(jobs[i].image_index);
+
+        BOOST_FOREACH(Worker& w, _workers) {
+            w.pool = this;
+            pthread_mutex_init(&w.lock, NULL);
+        }
+        size_t started = 0;
+        for (; started < worker_count; ++ started) {
+            if (pthread_create(&_workers[started].thread, NULL, &ExtractionPool::worker_main, &_workers[started]) != 0)
+                break;
+        }
+        // If no thread could be spawned at all, just do everything here.
+        if (started == 0)
+            this->run(_workers[0]);
+        for (size_t i = 0; i < started; ++ i)
+            pthread_join(_workers[i].thread, NULL);
+        BOOST_FOREACH(Worker& w, _workers)
+            pthread_mutex_destroy(&w.lock);
+    }
 };
 
 class ProgramContext {
     const char* _folder;
     char* _filename;
-    DataFile* _f;
+    DataFileSet _files;
+    const DataFile* _f;   // the main cache file, i.e. _files.file(0).
     bool _printmode;
     bool _uuidmode;
+    unsigned _jobs;
     std::vector<boost::filesystem::path> _namefilters;
-    boost::unordered_map<const mach_header*, boost::filesystem::path> _already_dumped;
+    boost::unordered_map<const void*, boost::filesystem::path> _already_dumped;
+    Manifest _manifest;
+    std::vector<bool> _intact;      // per image, see find_intact_images().
 
     const dyld_cache_header* _header;
     const shared_file_mapping_np* _mapping;
+    std::vector<std::pair<size_t, shared_file_mapping_np> > _subcache_mappings;
+    size_t _image_file_count;   // the main file and the '.N' subcaches, which hold the images.
     const dyld_cache_image_info* _images;
-    std::vector<MachOFile> _macho_files;
+    // Only the list matching the pointer width of the images is filled.
+    bool _is64;
+    std::vector<MachOFile<Arch32> > _macho_files_32;
+    std::vector<MachOFile<Arch64> > _macho_files_64;
+    SegmentIndex _segment_index;
+    CoalescedStringIndex _coalesced_strings;
+    ObjCSymbolIndex _objc_symbols;
+
+    // What index_objc_metadata() finds in each image before merging.
+    struct ObjCScan {
+        std::vector<uint64_t> foreign_selectors;
+        std::vector<std::pair<uint64_t, ObjCSymbolIndex::Entry> > symbols;
+    };
+    std::vector<ObjCScan> _objc_scans;
 
 public:
     ProgramContext() :
@@ -1035,7 +2431,10 @@ public:
         _filename(NULL),
         _f(NULL),
         _printmode(false),
-        _uuidmode(false)
+        _uuidmode(false),
+        _jobs(1),
+        _image_file_count(0),
+        _is64(false)
     {}
 
 private:
@@ -1045,7 +2444,7 @@ private:
         printf(
             "dyld_decache v0.1c\n"
             "Usage:\n"
-            "  %s [-p] [-u] [-o folder] [-f name [-f name] ...] path/to/dyld_shared_cache_armvX\n"
+            "  %s [-p] [-u] [-j jobs] [-o folder] [-f name [-f name] ...] path/to/dyld_shared_cache_armvX\n"
             "\n"
             "Options:\n"
             "  -o folder : Extract files into 'folder'. Default to './libraries'\n"
@@ -1055,13 +2454,19 @@ private:
             "              '-f liblockdown'. This option may be specified multiple times to\n"
             "              extract more than one file. If not specified, all files will be\n"
             "              extracted.\n"
+            "  -j jobs   : Extract 'jobs' files in parallel. Use '-j 0' to run one job per\n"
+            "              CPU. Default to 1.\n"
+            "\n"
+            "Use '-' as the path to read the cache from the standard input.\n"
+            "Images which an earlier run has already extracted into 'folder' from the\n"
+            "same cache are kept, so an interrupted extraction can simply be rerun.\n"
         , progname);
     }
 
     void parse_options(int argc, char* argv[]) {
         int opt;
 
-        while ((opt = getopt(argc, argv, "o:pulf:")) != -1) {
+        while ((opt = getopt(argc, argv, "o:pulf:j:")) != -1) {
             switch (opt) {
                 case 'o':
                     _folder = optarg;
@@ -1075,6 +2480,13 @@ private:
                 case 'f':
                     _namefilters.push_back(remove_all_extensions(optarg));
                     break;
+                case 'j':
+                    _jobs = static_cast<unsigned>(strtoul(optarg, NULL, 10));
+                    if (_jobs == 0) {
+                        long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+                        _jobs = cpu_count > 0 ? static_cast<unsigned>(cpu_count) : 1;
+                    }
+                    break;
                 case '?':
                 case -1:
                     break;
@@ -1092,54 +2504,132 @@ private:
         return !strncmp(_header->magic, "dyld_v1", 7);
     }
 
-    const mach_header* mach_header_of_image(int i) const {
-        return _macho_files[i].header();
+    std::vector<MachOFile<Arch32> >& macho_files(Arch32) { return _macho_files_32; }
+    std::vector<MachOFile<Arch64> >& macho_files(Arch64) { return _macho_files_64; }
+    const std::vector<MachOFile<Arch32> >& macho_files(Arch32) const { return _macho_files_32; }
+    const std::vector<MachOFile<Arch64> >& macho_files(Arch64) const { return _macho_files_64; }
+
+    const void* mach_header_of_image(uint32_t i) const {
+        if (_is64)
+            return _macho_files_64[i].header();
+        else
+            return _macho_files_32[i].header();
     }
 
-    off_t from_vmaddr(uint64_t vmaddr) const {
-        for (uint32_t i = 0; i < _header->mappingCount; ++ i) {
-            if (_mapping[i].sfm_address <= vmaddr && vmaddr < _mapping[i].sfm_address + _mapping[i].sfm_size)
-                return vmaddr - _mapping[i].sfm_address + _mapping[i].sfm_file_offset;
-        }
-        return -1;
+    const char* uuid_of_image(uint32_t i) const {
+        if (_is64)
+            return _macho_files_64[i].uuid();
+        else
+            return _macho_files_32[i].uuid();
     }
 
-    const char* peek_char_at_vmaddr(uint64_t vmaddr) const {
-        off_t offset = this->from_vmaddr(vmaddr);
-        if (offset >= 0) {
-            return _f->peek_data_at<char>(offset);
-        } else {
-            return NULL;
+    // Identify the cache by its header, mappings, images and size, and by the
+    //  sizes and mappings of the subcaches, which is much cheaper than reading
+    //  it all.
+    std::string cache_id() const {
+        uint64_t h = checksum_of(_header, sizeof(*_header));
+        h = checksum_of(_mapping, _header->mappingCount * sizeof(*_mapping), h);
+        h = checksum_of(_images, _header->imagesCount * sizeof(*_images), h);
+        for (uint32_t i = 0; i < _header->imagesCount; ++ i) {
+            const char* uuid = this->uuid_of_image(i);
+            h = checksum_of(uuid, strlen(uuid), h);
+        }
+        uint64_t file_size = _f->filesize();
+        h = checksum_of(&file_size, sizeof(file_size), h);
+        for (size_t i = 1; i < _files.file_count(); ++ i) {
+            boost::system::error_code ec;
+            uint64_t subcache_size = boost::filesystem::file_size(_files.path_of_file(i), ec);
+            h = checksum_of(&subcache_size, sizeof(subcache_size), h);
         }
+        for (size_t i = 0; i < _subcache_mappings.size(); ++ i)
+            h = checksum_of(&_subcache_mappings[i].second, sizeof(_subcache_mappings[i].second), h);
+
+        char id[17];
+        snprintf(id, sizeof(id), "%016llx", static_cast<unsigned long long>(h));
+        return id;
     }
-    
-    void process_export_trie_node(off_t start, off_t cur, off_t end, const std::string& prefix, uint32_t bias, boost::unordered_map<uint32_t, std::string>& exports) const {
-    	if (cur < end) {
-    		_f->seek(cur);
-    		unsigned char term_size = static_cast<unsigned char>(_f->read_char());
-    		if (term_size != 0) {
-    			/*unsigned flags =*/ _f->read_uleb128<unsigned>();
-    			unsigned addr = _f->read_uleb128<unsigned>() + bias;
-    			exports.insert(std::make_pair(addr, prefix));
-    		}
-    		_f->seek(cur + term_size + 1);
-    		unsigned char child_count = static_cast<unsigned char>(_f->read_char());
-    		off_t last_pos;
-    		for (unsigned char i = 0; i < child_count; ++ i) {
-    			const char* suffix = _f->read_string();
-    			unsigned offset = _f->read_uleb128<unsigned>();
-    			last_pos = _f->tell();
-    			this->process_export_trie_node(start, start + offset, end, prefix + suffix, bias, exports);
-    			_f->seek(last_pos);
-    		}
-    	}
+
+    uint64_t content_size_of_image(uint32_t i) const {
+        if (_is64)
+            return _macho_files_64[i].content_size();
+        else
+            return _macho_files_32[i].content_size();
     }
-    
+
+    template <typename A>
+    void load_images() {
+        std::vector<MachOFile<A> >& files = this->macho_files(A());
+        files.reserve(_header->imagesCount);
+        for (uint32_t i = 0; i < _header->imagesCount; ++ i) {
+            const typename A::mach_header_t* mh = this->peek_data_at_vmaddr<typename A::mach_header_t>(_images[i].address);
+            files.push_back(MachOFile<A>(mh, this, _images[i].address));
+            files.back().add_to_index(_segment_index, i);
+            files.back().find_uuid();
+        }
+    }
+
 public:
-    void fill_export(off_t start, off_t end, uint32_t bias, boost::unordered_map<uint32_t, std::string>& exports) const {
-        process_export_trie_node(start, start, end, "", bias, exports);
+    const DataFile& main_file() const { return *_f; }
+    const DataFileSet& files() const { return _files; }
+
+    // Find the cache file (main or subcache) and the offset in it of a VM
+    //  address, mapping the file if needed. Returns NULL if no file maps it.
+    const DataFile* locate_vmaddr(uint64_t vmaddr, off_t* p_offset) const {
+        return _files.locate(vmaddr, p_offset);
+    }
+
+    template <typename T>
+    const T* peek_data_at_vmaddr(uint64_t vmaddr) const {
+        off_t offset;
+        const DataFile* file = this->locate_vmaddr(vmaddr, &offset);
+        return file ? file->peek_data_at<T>(offset) : NULL;
+    }
+
+    const char* peek_char_at_vmaddr(uint64_t vmaddr) const {
+        return this->peek_data_at_vmaddr<char>(vmaddr);
+    }
+
+private:
+    // Split caches keep some of their mappings in 'name.1', 'name.2', ...,
+    //  and the local symbols in 'name.symbols'. Only their headers are read
+    //  here; the files are mapped when first touched.
+    void add_subcaches() {
+        _image_file_count = _files.file_count();
+        if (!strcmp(_filename, "-"))
+            return;
+        for (unsigned n = 1; ; ++ n) {
+            char suffix[16];
+            snprintf(suffix, sizeof(suffix), ".%u", n);
+            std::string path = std::string(_filename) + suffix;
+            if (!boost::filesystem::exists(path))
+                break;
+            this->add_subcache(path);
+        }
+        _image_file_count = _files.file_count();
+        std::string symbols_path = std::string(_filename) + ".symbols";
+        if (boost::filesystem::exists(symbols_path))
+            this->add_subcache(symbols_path);
+    }
+
+    void add_subcache(const std::string& path) {
+        size_t index = _files.add_file(path.c_str());
+        dyld_cache_header header;
+        if (!_files.read_at(index, 0, &header, sizeof(header)) || strncmp(header.magic, "dyld_v1", 7)) {
+            fprintf(stderr, "Warning: '%s' is not a dyld shared cache, ignored.\n", path.c_str());
+            return;
+        }
+        std::vector<shared_file_mapping_np> mappings (header.mappingCount);
+        if (!mappings.empty() && !_files.read_at(index, header.mappingOffset, &mappings[0], mappings.size() * sizeof(mappings[0]))) {
+            fprintf(stderr, "Warning: Cannot read the mappings of '%s', ignored.\n", path.c_str());
+            return;
+        }
+        BOOST_FOREACH(const shared_file_mapping_np& mapping, mappings) {
+            _files.add_range(mapping.sfm_address, mapping.sfm_size, index, mapping.sfm_file_offset);
+            _subcache_mappings.push_back(std::make_pair(index, mapping));
+        }
     }
 
+public:
     bool initialize(int argc, char* argv[]) {
         this->parse_options(argc, argv);
         if (_filename == NULL) {
@@ -1150,14 +2640,14 @@ public:
     }
 
     void close() {
-        if (_f) {
-            delete _f;
-            _f = NULL;
-        }
+        _files.clear();
+        _subcache_mappings.clear();
+        _f = NULL;
     }
 
     bool open() {
-        _f = new DataFile(_filename);
+        _files.add_file(_filename);
+        _f = &_files.file(0);
 
         _header = _f->peek_data_at<dyld_cache_header>(0);
         if (!this->check_magic()) {
@@ -1167,20 +2657,51 @@ public:
 
         _mapping = _f->peek_data_at<shared_file_mapping_np>(_header->mappingOffset);
         _images = _f->peek_data_at<dyld_cache_image_info>(_header->imagesOffset);
+        for (uint32_t i = 0; i < _header->mappingCount; ++ i)
+            _files.add_range(_mapping[i].sfm_address, _mapping[i].sfm_size, 0, _mapping[i].sfm_file_offset);
+        this->add_subcaches();
+
+        // Listing the images needs nothing but the main header, so do not
+        //  touch the subcaches holding the images.
+        _macho_files_32.clear();
+        _macho_files_64.clear();
+        if (!_printmode) {
+            // All images of a cache have the same pointer width as the first.
+            const mach_header* first = _header->imagesCount ? this->peek_data_at_vmaddr<mach_header>(_images[0].address) : NULL;
+            _is64 = first && first->magic == Arch64::magic;
+            if (_is64)
+                this->load_images<Arch64>();
+            else
+                this->load_images<Arch32>();
+            _segment_index.build();
+        }
+
+        // The read-only mappings hold __LINKEDIT, which is only ever accessed
+        //  at scattered places. Subcaches get the hint once they are mapped.
+        for (uint32_t i = 0; i < _header->mappingCount; ++ i) {
+            if (_mapping[i].sfm_init_prot == VM_PROT_READ)
+                _files.advise(0, _mapping[i].sfm_file_offset, _mapping[i].sfm_size, DataFile::AccessRandom);
+        }
+        typedef std::pair<size_t, shared_file_mapping_np> SubcacheMapping;
+        BOOST_FOREACH(const SubcacheMapping& sm, _subcache_mappings) {
+            if (sm.second.sfm_init_prot == VM_PROT_READ)
+                _files.advise(sm.first, sm.second.sfm_file_offset, sm.second.sfm_size, DataFile::AccessRandom);
+        }
         return true;
     }
     
-    uint32_t image_containing_address(uint32_t vmaddr, std::string* symname = NULL) const {
-        uint32_t i = 0;
-        BOOST_FOREACH(const MachOFile& mo, _macho_files) {
-            if (mo.contains_address(vmaddr)) {
-                if (symname)
-                    *symname = mo.exported_symbol(vmaddr);
-                return i;
-            }
-            ++ i;
-        }
-        return ~0u;
+    const SegmentIndex& segment_index() const { return _segment_index; }
+    const CoalescedStringIndex& coalesced_strings() const { return _coalesced_strings; }
+    const ObjCSymbolIndex& objc_symbols() const { return _objc_symbols; }
+
+    template <typename A>
+    uint32_t image_containing_address(uint64_t vmaddr, const char** symname = NULL) const {
+        const SegmentIndex::Interval* iv = _segment_index.find(vmaddr);
+        if (!iv)
+            return ~0u;
+        if (symname)
+            *symname = this->macho_files(A())[iv->image_index].exported_symbol(vmaddr);
+        return iv->image_index;
     }
     
     bool is_print_mode() const { return _printmode; }
@@ -1205,18 +2726,51 @@ public:
         return true;
     }
 
-    // Decache the file of the specified index. If the file is already decached
-    //  under a different name, create a symbolic link to it.
-    void save_complete_image(uint32_t image_index) {
+    boost::filesystem::path output_path_of_image(uint32_t image_index) const {
         boost::filesystem::path filename (_folder);
+        filename /= this->path_of_image(image_index);
+        return filename;
+    }
+
+    // Decache the file of the specified index. The symbolic link decisions
+    //  must have been made in save_complete_image() beforehand, so this can
+    //  be run from any thread.
+    template <typename A>
+    void dump_image_as(uint32_t image_index) {
+        boost::filesystem::path filename = this->output_path_of_image(image_index);
+        DecachingFile<A> df (filename, this->macho_files(A())[image_index], this);
+        if (!df.is_open())
+            perror("**** Failed");
+        if (df.is_complete())
+            _manifest.record(this->path_of_image(image_index), this->uuid_of_image(image_index), filename);
+    }
+
+    void dump_image(uint32_t image_index) {
+        if (_is64)
+            this->dump_image_as<Arch64>(image_index);
+        else
+            this->dump_image_as<Arch32>(image_index);
+    }
+
+    void print_parallel_dump(uint32_t image_index) {
+        printf("%3d/%d: Dumping '%s'...\n", image_index, _header->imagesCount, this->path_of_image(image_index));
+        this->dump_image(image_index);
+    }
+
+    // Decache the file of the specified index. If the file is already decached
+    //  under a different name, create a symbolic link to it. If 'deferred' is
+    //  given, the image is not decached immediately, but added to that list.
+    void save_complete_image(uint32_t image_index, std::vector<ExtractionPool<ProgramContext>::Job>* deferred = NULL) {
+        boost::filesystem::path filename = this->output_path_of_image(image_index);
         const char* path = this->path_of_image(image_index);
-        filename /= path;
 
-        const mach_header* header = this->mach_header_of_image(image_index);
-        boost::unordered_map<const mach_header*, boost::filesystem::path>::const_iterator cit = _already_dumped.find(header);
+        const void* header = this->mach_header_of_image(image_index);
+        boost::unordered_map<const void*, boost::filesystem::path>::const_iterator cit = _already_dumped.find(header);
 
         bool already_dumped = (cit != _already_dumped.end());
-        printf("%3d/%d: %sing '%s'...\n", image_index, _header->imagesCount, already_dumped ? "Link" : "Dump", path);
+        bool intact = !already_dumped && _intact[image_index];
+        if (already_dumped || intact || !deferred)
+            printf("%3d/%d: %sing '%s'...\n", image_index, _header->imagesCount, already_dumped ? "Link" : intact ? "Keep" : "Dump", path);
 
         if (already_dumped) {
             boost::system::error_code ec;
@@ -1238,44 +2792,126 @@ public:
 
         } else {
             _already_dumped.insert(std::make_pair(header, path));
-            DecachingFile df (filename, header, this);
-            if (!df.is_open())
-                perror("**** Failed");
+            if (intact)
+                return;     // extracted by an earlier run already.
+            if (deferred) {
+                // create the directories now, so the workers won't race on them.
+                boost::filesystem::create_directories(filename.parent_path());
+                ExtractionPool<ProgramContext>::Job job = {image_index, this->content_size_of_image(image_index)};
+                deferred->push_back(job);
+            } else {
+                this->dump_image(image_index);
+            }
         }
     }
 
-    void save_all_images() {
-        _macho_files.clear();
-        for (uint32_t i = 0; i < _header->imagesCount; ++ i) {
-            const mach_header* mh = _f->peek_data_at<mach_header>(this->from_vmaddr(_images[i].address));
-            MachOFile file = MachOFile(mh, this, _images[i].address);
-			file.prepare_for_save();
-            _macho_files.push_back(file);
+    template <typename A>
+    void scan_objc_as(uint32_t image_index) {
+        AddressSpaceView vm (_files);
+        const MachOFile<A>& file = this->macho_files(A())[image_index];
+        ObjCScan& scan = _objc_scans[image_index];
+        file.find_foreign_selectors(vm, &scan.foreign_selectors);
+        file.find_objc_symbols(vm, image_index, &scan.symbols);
+    }
+
+    void scan_objc(uint32_t image_index) {
+        if (_is64)
+            this->scan_objc_as<Arch64>(image_index);
+        else
+            this->scan_objc_as<Arch32>(image_index);
+    }
+
+    // Find the selector names referred to across images, and the classes and
+    //  metaclasses which may be linked to, once for the whole cache, so the
+    //  images need not look them up one by one. The images are scanned in
+    //  parallel, and the results merged afterwards.
+    void index_objc_metadata() {
+        uint32_t count = _header->imagesCount;
+        _objc_scans.assign(count, ObjCScan());
+        std::vector<ExtractionPool<ProgramContext>::Job> jobs;
+        for (uint32_t i = 0; i < count; ++ i) {
+            ExtractionPool<ProgramContext>::Job job = {i, this->content_size_of_image(i)};
+            jobs.push_back(job);
+        }
+        ExtractionPool<ProgramContext> pool (this, &ProgramContext::scan_objc, _jobs);
+        pool.execute(jobs);
+
+        std::vector<uint64_t> targets;
+        typedef std::pair<uint64_t, ObjCSymbolIndex::Entry> Symbol;
+        BOOST_FOREACH(const ObjCScan& scan, _objc_scans) {
+            targets.insert(targets.end(), scan.foreign_selectors.begin(), scan.foreign_selectors.end());
+            BOOST_FOREACH(const Symbol& symbol, scan.symbols)
+                _objc_symbols.add(symbol.first, symbol.second);
+        }
+        _objc_scans.clear();
+        std::sort(targets.begin(), targets.end());
+        targets.erase(std::unique(targets.begin(), targets.end()), targets.end());
+
+        AddressSpaceView vm (_files);
+        BOOST_FOREACH(uint64_t vmaddr, targets) {
+            const char* string = vm.string_at(vmaddr);
+            if (string)
+                _coalesced_strings.add(vmaddr, string);
         }
+    }
 
-        for (uint32_t i = 0; i < _header->imagesCount; ++ i) {
-            if (!this->should_skip_image(i)) {
-                this->save_complete_image(i);
-            }
+    // Check which images an earlier run has extracted intact already, before
+    //  anything else is read. Images sharing a header are only checked once,
+    //  as the others are linked to it. Returns the number left to extract.
+    uint32_t find_intact_images() {
+        uint32_t count = _header->imagesCount;
+        uint32_t pending = 0;
+        _intact.assign(count, false);
+        boost::unordered_map<const void*, uint32_t> first_with_header;
+        for (uint32_t i = 0; i < count; ++ i) {
+            if (this->should_skip_image(i) || !first_with_header.insert(std::make_pair(this->mach_header_of_image(i), i)).second)
+                continue;
+            _intact[i] = _manifest.is_intact(this->path_of_image(i), this->uuid_of_image(i), this->output_path_of_image(i));
+            if (!_intact[i])
+                ++ pending;
         }
+        return pending;
     }
 
-    void print_uuids() {
-        _macho_files.clear();
-        for (uint32_t i = 0; i < _header->imagesCount; ++ i) {
-            const mach_header* mh = _f->peek_data_at<mach_header>(this->from_vmaddr(_images[i].address));
-            MachOFile file = MachOFile(mh, this, _images[i].address);
-			file.find_uuid();
-            _macho_files.push_back(file);
+    void save_all_images() {
+        _manifest.open(_folder, this->cache_id());
+        // Extracting most images reads most of the cache, so read it in one go
+        //  rather than fault it in page by page, and index what the images
+        //  share once. Neither pays off for a few images, e.g. with -f or when
+        //  an earlier run has extracted nearly everything.
+        uint32_t pending = this->find_intact_images();
+        if (pending > 0 && pending * 2 >= _header->imagesCount) {
+            for (size_t i = 0; i < _image_file_count; ++ i)
+                _files.set_map_options(i, DataFile::MapPopulate | DataFile::MapHugePages);
+            this->index_objc_metadata();
+        }
+        if (_jobs <= 1) {
+            for (uint32_t i = 0; i < _header->imagesCount; ++ i) {
+                if (!this->should_skip_image(i)) {
+                    this->save_complete_image(i);
+                }
+            }
+        } else {
+            std::vector<ExtractionPool<ProgramContext>::Job> jobs;
+            for (uint32_t i = 0; i < _header->imagesCount; ++ i) {
+                if (!this->should_skip_image(i)) {
+                    this->save_complete_image(i, &jobs);
+                }
+            }
+
+            ExtractionPool<ProgramContext> pool (this, &ProgramContext::print_parallel_dump, _jobs);
+            pool.execute(jobs);
         }
+    }
 
+    void print_uuids() const {
         printf(
             "Images (%d):\n"
             "  ---------address  --------------------------------uuid  filename\n"
         , _header->imagesCount);
 
         for (uint32_t i = 0; i < _header->imagesCount; ++ i) {
-            printf("  %16llx  %s  %s\n", _images[i].address, _macho_files[i].uuid(), this->path_of_image(i));
+            printf("  %16llx  %s  %s\n", static_cast<unsigned long long>(_images[i].address), this->uuid_of_image(i), this->path_of_image(i));
         }
     }
 
@@ -1285,15 +2921,35 @@ public:
             "\n"
             "Mappings (%d):\n"
             "  ---------address  ------------size  ----------offset  prot\n"
-        , _header->magic, _header->dyldBaseAddress, _header->mappingCount);
+        , _header->magic, static_cast<unsigned long long>(_header->dyldBaseAddress), _header->mappingCount);
 
         for (uint32_t i = 0; i < _header->mappingCount; ++ i) {
             printf("  %16llx  %16llx  %16llx  %x (<= %x)\n",
-                _mapping[i].sfm_address, _mapping[i].sfm_size, _mapping[i].sfm_file_offset,
+                static_cast<unsigned long long>(_mapping[i].sfm_address),
+                static_cast<unsigned long long>(_mapping[i].sfm_size),
+                static_cast<unsigned long long>(_mapping[i].sfm_file_offset),
                 _mapping[i].sfm_init_prot, _mapping[i].sfm_max_prot
             );
         }
 
+        if (_files.file_count() > 1) {
+            printf(
+                "\n"
+                "Subcache mappings (%lu):\n"
+                "  ---------address  ------------size  ----------offset  prot  file\n"
+            , static_cast<unsigned long>(_subcache_mappings.size()));
+
+            for (size_t i = 0; i < _subcache_mappings.size(); ++ i) {
+                const shared_file_mapping_np& mapping = _subcache_mappings[i].second;
+                printf("  %16llx  %16llx  %16llx  %x (<= %x)  %s\n",
+                    static_cast<unsigned long long>(mapping.sfm_address),
+                    static_cast<unsigned long long>(mapping.sfm_size),
+                    static_cast<unsigned long long>(mapping.sfm_file_offset),
+                    mapping.sfm_init_prot, mapping.sfm_max_prot, _files.path_of_file(_subcache_mappings[i].first)
+                );
+            }
+        }
+
         printf(
             "\n"
             "Images (%d):\n"
@@ -1301,207 +2957,282 @@ public:
         , _header->imagesCount);
 
         for (uint32_t i = 0; i < _header->imagesCount; ++ i) {
-            printf("  %16llx  %s\n", _images[i].address, this->path_of_image(i));
+            printf("  %16llx  %s\n", static_cast<unsigned long long>(_images[i].address), this->path_of_image(i));
         }
     }
 
     ~ProgramContext() { close(); }
 
-    friend class DecachingFile;
+    template <typename A> friend class DecachingFile;
 };
 
 
-void MachOFile::retrieve_segments_and_libords(const load_command* cmd) {
-    switch (cmd->cmd) {
-        default:
-            break;
-        case LC_SEGMENT: {
-            const segment_command* segcmd = static_cast<const segment_command*>(cmd);
-            _segments.push_back(segcmd);
-            break;
-        }
-        case LC_LOAD_DYLIB:
-        case LC_ID_DYLIB:
-        case LC_LOAD_WEAK_DYLIB:
-        case LC_REEXPORT_DYLIB:
-        case LC_LAZY_LOAD_DYLIB:
-        case LC_LOAD_UPWARD_DYLIB: {
-            const dylib_command* dlcmd = static_cast<const dylib_command*>(cmd);
-            std::string dlname (dlcmd->dylib.name + reinterpret_cast<const char*>(dlcmd));
-            _libords.insert(std::make_pair(dlname, _cur_libord));
-            ++ _cur_libord;
-            break;
-        }
-        
-        case LC_DYLD_INFO:
-        case LC_DYLD_INFO_ONLY: {
-            if (_image_vmaddr) {
-                const dyld_info_command* dicmd = static_cast<const dyld_info_command*>(cmd);
-                if (dicmd->export_off)
-                    _context->fill_export(dicmd->export_off, dicmd->export_off + dicmd->export_size, _image_vmaddr, _exports);
-            }
-            break;
-        }
+template <typename A>
+int MachOFile<A>::segnum_containing(pointer_t vmaddr) const {
+    const SegmentIndex::Interval* iv = _context->segment_index().find(vmaddr);
+    if (!iv)
+        return -1;
+    if (iv->header == _header)
+        return iv->segnum;
+    if (!iv->shared)
+        return -1;
+
+    // The range is shared by several images, and the index only remembers
+    //  the first one. Check our own segments.
+    int i = 0;
+    BOOST_FOREACH(const segment_command_t* segcmd, _commands->segments) {
+        if (segcmd->vmaddr <= vmaddr && vmaddr < segcmd->vmaddr + segcmd->vmsize)
+            return i;
+        ++ i;
     }
+    return -1;
 }
 
-void MachOFile::retrieve_uuid(const load_command* cmd) {
-    switch (cmd->cmd) {
-        default:
-            break;
-		case LC_UUID:
-			const uuid_command* uuidcmd = static_cast<const uuid_command*>(cmd);
-			char uuid[37];
-			sprintf(uuid, "%02X%02X%02X%02X-%02X%02X-%02X%02X-%02X%02X-%02X%02X%02X%02X%02X%02X",
-					uuidcmd->byte0, uuidcmd->byte1, uuidcmd->byte2, uuidcmd->byte3,
-					uuidcmd->byte4, uuidcmd->byte5, uuidcmd->byte6, uuidcmd->byte7,
-					uuidcmd->byte8, uuidcmd->byte9, uuidcmd->byte10, uuidcmd->byte11,
-					uuidcmd->byte12, uuidcmd->byte13, uuidcmd->byte14, uuidcmd->byte15);
-			_uuid = uuid;
-			break;
+template <typename A>
+const DataFile* MachOFile<A>::locate_fileoff(uint32_t fileoff, off_t* p_offset) const {
+    BOOST_FOREACH(const segment_command_t* segcmd, _commands->segments) {
+        if (segcmd->fileoff <= fileoff && fileoff - segcmd->fileoff < segcmd->filesize)
+            return _context->locate_vmaddr(segcmd->vmaddr + (fileoff - segcmd->fileoff), p_offset);
     }
+    // Not in any segment: take it as an offset in the main cache file.
+    *p_offset = fileoff;
+    return &_context->main_file();
 }
 
-void DecachingFile::write_segment_content(const segment_command* segcmd) {
-    if (!streq(segcmd->segname, "__LINKEDIT")) {
-        ExtraStringRepository* repo = this->repo_for_segname(segcmd->segname);
-
-        const char* data_ptr = _context->peek_char_at_vmaddr(segcmd->vmaddr);
-        long new_fileoff = ftell(_f);
+template <typename A>
+void MachOFile<A>::load_exports() const {
+    // Once set, the flag never changes, so only the first lookup needs the
+    //  lock. Each image has a lock of its own, so the tries of different
+    //  images are decoded in parallel.
+#if defined(__GNUC__)
+    if (__atomic_load_n(&_exports_loaded, __ATOMIC_ACQUIRE))
+        return;
+#endif
+
+    _exports_lock.lock();
+    if (!_exports_loaded) {
+        try {
+            off_t offset;
+            const DataFile* file;
+            const dyld_info_command* dicmd = _commands->dyld_info;
+            if (_image_vmaddr && dicmd && dicmd->export_off && (file = this->locate_fileoff(dicmd->export_off, &offset)))
+                ExportTrie(file->span(offset, dicmd->export_size)).fill_map(_image_vmaddr, _exports, _export_names);
+        } catch (...) {
+            _exports_lock.unlock();
+            throw;
+        }
+#if defined(__GNUC__)
+        __atomic_store_n(&_exports_loaded, true, __ATOMIC_RELEASE);
+#else
+        _exports_loaded = true;
+#endif
+    }
+    _exports_lock.unlock();
+}
 
-        fwrite(data_ptr, 1, segcmd->filesize, _f);
+// Decide where each segment and extra section will be placed in the output
+//  file, before anything is written.
+template <typename A>
+void DecachingFile<A>::plan_segment_layout() {
+    long cur_fileoff = 0;
+    std::vector<std::pair<const segment_command_t*, uint32_t> > fixups;
+    std::vector<long> new_fileoffs;
+    BOOST_FOREACH(const segment_command_t* segcmd, _commands->segments) {
+        if (streq(segcmd->segname, "__LINKEDIT"))
+            continue;
+
+        ExtraStringRepository<A>* repo = this->repo_for_segname(segcmd->segname);
+        long new_fileoff = cur_fileoff;
         uint32_t filesize = segcmd->filesize;
+        cur_fileoff += filesize;
 
         if (repo && repo->has_content()) {
-            repo->foreach_entry(this, &DecachingFile::write_extrastr);
-
+            cur_fileoff += repo->total_size();
             // make sure the section is aligned on 8-byte boundary...
-            long extra = ftell(_f) % 8;
+            long extra = cur_fileoff % 8;
             if (extra) {
-                char padding[8] = {0};
-                fwrite(padding, 1, 8-extra, _f);
                 repo->increase_size_by(8-extra);
+                cur_fileoff += 8-extra;
             }
             repo->set_section_fileoff(new_fileoff + filesize);
             filesize += repo->total_size();
         }
 
-        FileoffFixup fixup = {segcmd->fileoff, segcmd->fileoff + filesize, segcmd->fileoff - new_fileoff};
-        _fixups.push_back(fixup);
+        fixups.push_back(std::make_pair(segcmd, filesize));
+        new_fileoffs.push_back(new_fileoff);
+    }
+
+    // A later segment takes precedence over an earlier one it overlaps.
+    for (size_t i = fixups.size(); i -- > 0; ) {
+        uint64_t fileoff = fixups[i].first->fileoff;
+        _fileoff_fixups.add(fileoff, fileoff + fixups[i].second, static_cast<int64_t>(new_fileoffs[i]) - static_cast<int64_t>(fileoff));
+    }
+    _fileoff_fixups.build();
+    _linkedit_offset = static_cast<uint32_t>(cur_fileoff);
+    _linkedit_size = 0;
+}
+
+template <typename A>
+void DecachingFile<A>::flush_file() {
+    if (!_out.flush(*_file)) {
+        perror("**** Failed");
+        return;
+    }
+    _complete = _file->close();
+    if (!_complete)
+        perror("**** Failed");
+}
+
+// Start reading in the segments of this image while the earlier ones are
+//  being copied.
+template <typename A>
+void DecachingFile<A>::prefetch_segments() const {
+    BOOST_FOREACH(const segment_command_t* segcmd, _commands->segments) {
+        if (streq(segcmd->segname, "__LINKEDIT"))
+            continue;
+        off_t offset;
+        const DataFile* file = _context->locate_vmaddr(segcmd->vmaddr, &offset);
+        if (file)
+            file->advise(offset, segcmd->filesize, DataFile::AccessWillNeed);
+    }
+}
+
+template <typename A>
+void DecachingFile<A>::write_segment_content(const segment_command_t* segcmd) {
+    if (!streq(segcmd->segname, "__LINKEDIT")) {
+        ExtraStringRepository<A>* repo = this->repo_for_segname(segcmd->segname);
+
+        off_t src_offset;
+        const DataFile* file = _context->locate_vmaddr(segcmd->vmaddr, &src_offset);
+        if (file)
+            _out.copy_from_input(*file, src_offset, segcmd->filesize);
+
+        if (repo && repo->has_content()) {
+            repo->foreach_entry(this, &DecachingFile::write_extrastr);
+            // the padding was already counted in plan_segment_layout().
+            _out.align(8);
+        }
     }
 }
 
-void DecachingFile::write_real_linkedit(const load_command* cmd) {
-    const unsigned char* data_ptr = _context->_f->data();
+template <typename A>
+void DecachingFile<A>::write_real_linkedit() {
+    off_t src_offset;
+    const DataFile* file;
 
     // Write all data in [offmem .. offmem+countmem*objsize] to the output file,
     //  and pad to make sure the beginning is aligned with 'objsize' boundary.
     #define TRY_WRITE(offmem, countmem, objsize) \
-        if (cmdvar->offmem && cmdvar->countmem) { \
-            long curloc = ftell(_f); \
-            long extra = curloc % objsize; \
-            if (extra != 0) { \
-                char padding[objsize] = {0}; \
-                fwrite(padding, 1, objsize-extra, _f); \
-                curloc += objsize-extra; \
-            } \
-            _new_linkedit_offsets.offmem = curloc; \
-            fwrite(cmdvar->offmem + data_ptr, cmdvar->countmem * objsize, 1, _f); \
-        }
-
-    switch (cmd->cmd) {
-        default:
-            break;
-
-        case LC_DYLD_INFO:
-        case LC_DYLD_INFO_ONLY: {
-            const dyld_info_command* cmdvar = static_cast<const dyld_info_command*>(cmd);
-            TRY_WRITE(rebase_off, rebase_size, 1);
-            long curloc = ftell(_f);
-            long extra_size = _extra_bind.optimize_and_write(_f);
-            TRY_WRITE(bind_off, bind_size, 1);
-            _new_linkedit_offsets.bind_off = curloc;
-            _new_linkedit_offsets.bind_size += extra_size;
-            TRY_WRITE(weak_bind_off, weak_bind_size, 1);
-            TRY_WRITE(lazy_bind_off, lazy_bind_size, 1);
-            TRY_WRITE(export_off, export_size, 1);
-            break;
+        if (cmdvar->offmem && cmdvar->countmem && (file = this->locate_fileoff(cmdvar->offmem, &src_offset))) { \
+            _out.align(objsize); \
+            _new_linkedit_offsets.offmem = _out.tell(); \
+            _out.copy_from_input(*file, src_offset, cmdvar->countmem * objsize); \
         }
 
-        case LC_SYMTAB: {
-            // The string table is shared by all library, so naively using
-            //  TRY_WRITE will create a huge file with lots of unnecessary
-            //  strings. Therefore, we have to scan through all symbols and only
-            //  take those strings which are used by the symbol.
-            const symtab_command* cmdvar = static_cast<const symtab_command*>(cmd);
-            if (cmdvar->symoff && cmdvar->nsyms) {
-                _new_linkedit_offsets.stroff = ftell(_f);
-
-                nlist* syms = new nlist[cmdvar->nsyms];
-                memcpy(syms, _context->_f->peek_data_at<nlist>(cmdvar->symoff), sizeof(*syms) * cmdvar->nsyms);
-
-                int32_t cur_strx = 0;
-                for (uint32_t i = 0; i < cmdvar->nsyms; ++ i) {
-                    const char* the_string = _context->_f->peek_data_at<char>(syms[i].n_strx + cmdvar->stroff);
-                    size_t entry_len = strlen(the_string) + 1;
-                    fwrite(the_string, entry_len, 1, _f);
-                    syms[i].n_strx = cur_strx;
-                    cur_strx += entry_len;
-                }
-                _new_linkedit_offsets.strsize = cur_strx;
-
-                long curloc = ftell(_f);
-                long extra = curloc % sizeof(nlist);
-                if (extra != 0) {
-                    char padding[sizeof(nlist)] = {0};
-                    fwrite(padding, 1, sizeof(nlist)-extra, _f);
-                    curloc += sizeof(nlist)-extra;
-                }
-                _new_linkedit_offsets.symoff = curloc;
-                fwrite(syms, cmdvar->nsyms, sizeof(nlist), _f);
+    BOOST_FOREACH(const load_command* cmd, _commands->all) {
+        switch (cmd->cmd) {
+            default:
+                break;
 
-                delete[] syms;
+            case LC_DYLD_INFO:
+            case LC_DYLD_INFO_ONLY: {
+                const dyld_info_command* cmdvar = static_cast<const dyld_info_command*>(cmd);
+                TRY_WRITE(rebase_off, rebase_size, 1);
+                long curloc = _out.tell();
+                long extra_size = _extra_bind.optimize_and_write(_out);
+                TRY_WRITE(bind_off, bind_size, 1);
+                _new_linkedit_offsets.bind_off = curloc;
+                _new_linkedit_offsets.bind_size += extra_size;
+                TRY_WRITE(weak_bind_off, weak_bind_size, 1);
+                TRY_WRITE(lazy_bind_off, lazy_bind_size, 1);
+                TRY_WRITE(export_off, export_size, 1);
+                break;
             }
 
-            break;
-        }
+            case LC_SYMTAB: {
+                // The string table is shared by all library, so naively using
+                //  TRY_WRITE will create a huge file with lots of unnecessary
+                //  strings. Therefore, we have to scan through all symbols and only
+                //  take those strings which are used by the symbol.
+                const symtab_command* cmdvar = static_cast<const symtab_command*>(cmd);
+                off_t strtab_offset;
+                const DataFile* strtab_file = this->locate_fileoff(cmdvar->stroff, &strtab_offset);
+                if (cmdvar->symoff && cmdvar->nsyms && strtab_file && (file = this->locate_fileoff(cmdvar->symoff, &src_offset))) {
+                    _new_linkedit_offsets.stroff = _out.tell();
+
+                    nlist_t* syms = new nlist_t[cmdvar->nsyms];
+                    memcpy(syms, file->peek_data_at<nlist_t>(src_offset), sizeof(*syms) * cmdvar->nsyms);
+
+                    // A symbol whose name is out of the string table is left unnamed.
+                    StringTableBuilder strtab;
+                    for (uint32_t i = 0; i < cmdvar->nsyms; ++ i) {
+                        const char* the_string = NULL;
+                        if (static_cast<uint32_t>(syms[i].n_strx) < cmdvar->strsize)
+                            the_string = strtab_file->peek_data_at<char>(syms[i].n_strx + strtab_offset);
+                        syms[i].n_strx = strtab.add(the_string ? the_string : "");
+                    }
+                    strtab.build();
+                    for (uint32_t i = 0; i < cmdvar->nsyms; ++ i)
+                        syms[i].n_strx = strtab.offset_of(syms[i].n_strx);
+                    _out.write(strtab.data(), strtab.size());
+                    _new_linkedit_offsets.strsize = strtab.size();
 
-        case LC_DYSYMTAB: {
-            const dysymtab_command* cmdvar = static_cast<const dysymtab_command*>(cmd);
-            TRY_WRITE(tocoff, ntoc, 8);
-            TRY_WRITE(modtaboff, nmodtab, 52);
-            TRY_WRITE(extrefsymoff, nextrefsyms, 4);
-            TRY_WRITE(indirectsymoff, nindirectsyms, 4);
-            TRY_WRITE(extreloff, nextrel, 8);
-            TRY_WRITE(locreloff, nlocrel, 8);
-            break;
-        }
+                    _out.align(sizeof(nlist_t));
+                    _new_linkedit_offsets.symoff = _out.tell();
+                    _out.write(syms, cmdvar->nsyms * sizeof(nlist_t));
 
-        case LC_CODE_SIGNATURE:
-        case LC_SEGMENT_SPLIT_INFO:
-        case LC_FUNCTION_STARTS: {
-            const linkedit_data_command* cmdvar = static_cast<const linkedit_data_command*>(cmd);
-            TRY_WRITE(dataoff, datasize, 1);
-            if (cmd->cmd == LC_CODE_SIGNATURE)
-                _new_linkedit_offsets.dataoff_cs = _new_linkedit_offsets.dataoff;
-            else if (cmd->cmd == LC_SEGMENT_SPLIT_INFO)
-                _new_linkedit_offsets.dataoff_ssi = _new_linkedit_offsets.dataoff;
-            else if (cmd->cmd == LC_FUNCTION_STARTS)
-                _new_linkedit_offsets.dataoff_fs = _new_linkedit_offsets.dataoff;
-            break;
+                    delete[] syms;
+                }
+                break;
+            }
+
+            case LC_DYSYMTAB: {
+                const dysymtab_command* cmdvar = static_cast<const dysymtab_command*>(cmd);
+                TRY_WRITE(tocoff, ntoc, 8);
+                TRY_WRITE(modtaboff, nmodtab, A::dylib_module_size);
+                TRY_WRITE(extrefsymoff, nextrefsyms, 4);
+                TRY_WRITE(indirectsymoff, nindirectsyms, 4);
+                TRY_WRITE(extreloff, nextrel, 8);
+                TRY_WRITE(locreloff, nlocrel, 8);
+                break;
+            }
+
+            case LC_CODE_SIGNATURE:
+            case LC_SEGMENT_SPLIT_INFO:
+            case LC_FUNCTION_STARTS: {
+                const linkedit_data_command* cmdvar = static_cast<const linkedit_data_command*>(cmd);
+                TRY_WRITE(dataoff, datasize, 1);
+                if (cmd->cmd == LC_CODE_SIGNATURE)
+                    _new_linkedit_offsets.dataoff_cs = _new_linkedit_offsets.dataoff;
+                else if (cmd->cmd == LC_SEGMENT_SPLIT_INFO)
+                    _new_linkedit_offsets.dataoff_ssi = _new_linkedit_offsets.dataoff;
+                else if (cmd->cmd == LC_FUNCTION_STARTS)
+                    _new_linkedit_offsets.dataoff_fs = _new_linkedit_offsets.dataoff;
+                break;
+            }
         }
     }
 
     #undef TRY_WRITE
 }
 
-void DecachingFile::get_address_info(uint32_t vmaddr, std::string* p_name, int* p_libord) const {
-    uint32_t which_image = _context->image_containing_address(vmaddr, p_name);
+template <typename A>
+void DecachingFile<A>::get_address_info(pointer_t vmaddr, const char** p_name, int* p_libord) const {
+    // Classes and metaclasses are found in the cache-wide index, if built.
+    uint32_t which_image;
+    const ObjCSymbolIndex::Entry* entry = _context->objc_symbols().find(vmaddr);
+    if (entry) {
+        which_image = entry->image_index;
+        *p_name = entry->symname;
+    } else {
+        which_image = _context->template image_containing_address<A>(vmaddr, p_name);
+    }
     const char* image_name = _context->path_of_image(which_image);
     *p_libord = this->libord_with_name(image_name);
 }
 
-void DecachingFile::add_extlink_to(uint32_t vmaddr, uint32_t override_vmaddr) {
+template <typename A>
+void DecachingFile<A>::add_extlink_to(pointer_t vmaddr, pointer_t override_vmaddr) {
     if (!vmaddr)
         return;
     if (this->contains_address(vmaddr))
@@ -1512,98 +3243,322 @@ void DecachingFile::add_extlink_to(uint32_t vmaddr, uint32_t override_vmaddr) {
     _nullify_patches.push_back(override_vmaddr);
 }
 
+template <typename A>
 template <typename T>
-void DecachingFile::prepare_patch_objc_list(uint32_t list_vmaddr, uint32_t override_vmaddr) {
+void DecachingFile<A>::prepare_patch_objc_list(pointer_t list_vmaddr, pointer_t override_vmaddr) {
     if (!list_vmaddr)
         return;
 
-    off_t offset = _context->from_vmaddr(list_vmaddr);
-    _context->_f->seek(offset);
-    uint32_t entsize = _context->_f->copy_data<uint32_t>() & ~(uint32_t)3;
-    uint32_t count = _context->_f->copy_data<uint32_t>();
+    const uint32_t* list = this->template at_vmaddr<uint32_t>(list_vmaddr, 2);
+    if (!list)
+        return;
+    uint32_t entsize = list[0] & ~(uint32_t)3;
+    uint32_t count = list[1];
 
     if (entsize != sizeof(T))
         throw TRException("DecachingFile::prepare_patch_objc_list():\n\tWrong entsize: %u instead of %lu\n", entsize, sizeof(T));
 
+    const T* objects = this->template at_vmaddr<T>(list_vmaddr + 8, count);
+    if (!objects)
+        return;
+
     if (!this->contains_address(list_vmaddr)) {
         list_vmaddr = _extra_data.next_vmaddr();
         size_t size = 8 + sizeof(T)*count;
-        _extra_data.insert(_context->_f->peek_data_at<char>(offset), size, override_vmaddr);
+        _extra_data.insert(reinterpret_cast<const char*>(list), size, override_vmaddr);
     }
 
-    const T* objects = _context->_f->peek_data<T>();
     for (uint32_t j = 0; j < count; ++ j) {
         if (!this->contains_address(objects[j].name)) {
-            const char* the_string = _context->peek_char_at_vmaddr(objects[j].name);
-            _extra_text.insert(the_string, list_vmaddr + 8 + sizeof(T)*j);
+            size_t size;
+            const char* the_string = this->extra_string_at(objects[j].name, &size);
+            if (the_string)
+                _extra_text.insert(the_string, size, list_vmaddr + 8 + sizeof(T)*j);
         }
     }
 }
 
-void DecachingFile::prepare_objc_extrastr(const segment_command* segcmd) {
-    if (streq(segcmd->segname, "__DATA")) {
-        const section* sects = reinterpret_cast<const section*>(1 + segcmd);
-        for (uint32_t i = 0; i < segcmd->nsects; ++ i) {
-            const section& sect = sects[i];
+template <typename A>
+void DecachingFile<A>::prepare_objc_extrastr() {
+    typedef class_t<pointer_t> class_type;
+    typedef class_ro_t<pointer_t> class_ro_type;
+    typedef protocol_t<pointer_t> protocol_type;
+    typedef category_t<pointer_t> category_type;
+
+    BOOST_FOREACH(const section_t* sectptr, _commands->sections) {
+        const section_t& sect = *sectptr;
+        if (streq(sect.segname, "__DATA")) {
+            pointer_t count = sect.size / sizeof(pointer_t);
             if (streq(sect.sectname, "__objc_selrefs")) {
-                const uint32_t* refs = _context->_f->peek_data_at<uint32_t>(sect.offset);
-                for (uint32_t j = 0; j < sect.size/4; ++ j) {
-                    if (!this->contains_address(refs[j])) {
-                        const char* the_string = _context->peek_char_at_vmaddr(refs[j]);
-                        _extra_text.insert(the_string, sect.addr + 4*j);
-                    }
+                const pointer_t* refs = this->template at_vmaddr<pointer_t>(sect.addr, count);
+                std::vector<size_t> outliers;
+                if (refs)
+                    this->find_foreign_pointers(refs, count, &outliers);
+                BOOST_FOREACH(size_t j, outliers) {
+                    size_t size;
+                    const char* the_string = this->extra_string_at(refs[j], &size);
+                    if (the_string)
+                        _extra_text.insert(the_string, size, sect.addr + sizeof(pointer_t)*j);
                 }
             } else if (streq(sect.sectname, "__objc_classlist")) {
-                const uint32_t* classes = _context->_f->peek_data_at<uint32_t>(sect.offset);
-                for (uint32_t j = 0; j < sect.size/4; ++ j) {
-                    uint32_t class_vmaddr = classes[j];
-                    const class_t* class_obj = reinterpret_cast<const class_t*>(_context->peek_char_at_vmaddr(class_vmaddr));
-                    this->add_extlink_to(class_obj->superclass, class_vmaddr + offsetof(class_t, superclass));
-                    const class_ro_t* class_data = reinterpret_cast<const class_ro_t*>(_context->peek_char_at_vmaddr(class_obj->data));
-                    this->prepare_patch_objc_list<method_t>(class_data->baseMethods, class_obj->data + offsetof(class_ro_t, baseMethods));
-                    this->prepare_patch_objc_list<property_t>(class_data->baseProperties, class_obj->data + offsetof(class_ro_t, baseProperties));
+                const pointer_t* classes = this->template at_vmaddr<pointer_t>(sect.addr, count);
+                for (pointer_t j = 0; classes && j < count; ++ j) {
+                    pointer_t class_vmaddr = classes[j];
+                    const class_type* class_obj = this->template at_vmaddr<class_type>(class_vmaddr);
+                    if (!class_obj)
+                        continue;
+                    this->add_extlink_to(class_obj->superclass, class_vmaddr + offsetof(class_type, superclass));
+                    const class_ro_type* class_data = this->template at_vmaddr<class_ro_type>(class_obj->data);
+                    if (class_data) {
+                        this->template prepare_patch_objc_list<method_t<pointer_t> >(class_data->baseMethods, class_obj->data + offsetof(class_ro_type, baseMethods));
+                        this->template prepare_patch_objc_list<property_t<pointer_t> >(class_data->baseProperties, class_obj->data + offsetof(class_ro_type, baseProperties));
+                    }
                     
-                    const class_t* metaclass_obj = reinterpret_cast<const class_t*>(_context->peek_char_at_vmaddr(class_obj->isa));
-                    this->add_extlink_to(metaclass_obj->isa, class_obj->isa + offsetof(class_t, isa));
-                    this->add_extlink_to(metaclass_obj->superclass, class_obj->isa + offsetof(class_t, superclass));
-                    const class_ro_t* metaclass_data = reinterpret_cast<const class_ro_t*>(_context->peek_char_at_vmaddr(metaclass_obj->data));
-                    this->prepare_patch_objc_list<method_t>(metaclass_data->baseMethods, metaclass_obj->data + offsetof(class_ro_t, baseMethods));
-                    this->prepare_patch_objc_list<property_t>(metaclass_data->baseProperties, metaclass_obj->data + offsetof(class_ro_t, baseProperties));
+                    const class_type* metaclass_obj = this->template at_vmaddr<class_type>(class_obj->isa);
+                    if (!metaclass_obj)
+                        continue;
+                    this->add_extlink_to(metaclass_obj->isa, class_obj->isa + offsetof(class_type, isa));
+                    this->add_extlink_to(metaclass_obj->superclass, class_obj->isa + offsetof(class_type, superclass));
+                    const class_ro_type* metaclass_data = this->template at_vmaddr<class_ro_type>(metaclass_obj->data);
+                    if (metaclass_data) {
+                        this->template prepare_patch_objc_list<method_t<pointer_t> >(metaclass_data->baseMethods, metaclass_obj->data + offsetof(class_ro_type, baseMethods));
+                        this->template prepare_patch_objc_list<property_t<pointer_t> >(metaclass_data->baseProperties, metaclass_obj->data + offsetof(class_ro_type, baseProperties));
+                    }
                 }
             } else if (streq(sect.sectname, "__objc_protolist")) {
-                const uint32_t* protos = _context->_f->peek_data_at<uint32_t>(sect.offset);
-                for (uint32_t j = 0; j < sect.size/4; ++ j) {
-                    uint32_t proto_vmaddr = protos[j];
-                    const protocol_t* proto_obj = reinterpret_cast<const protocol_t*>(_context->peek_char_at_vmaddr(proto_vmaddr));
-                    this->prepare_patch_objc_list<method_t>(proto_obj->instanceMethods, proto_vmaddr + offsetof(protocol_t, instanceMethods));
-                    this->prepare_patch_objc_list<method_t>(proto_obj->classMethods, proto_vmaddr + offsetof(protocol_t, classMethods));
-                    this->prepare_patch_objc_list<method_t>(proto_obj->optionalInstanceMethods, proto_vmaddr + offsetof(protocol_t, optionalInstanceMethods));
-                    this->prepare_patch_objc_list<method_t>(proto_obj->optionalClassMethods, proto_vmaddr + offsetof(protocol_t, optionalClassMethods));
+                const pointer_t* protos = this->template at_vmaddr<pointer_t>(sect.addr, count);
+                for (pointer_t j = 0; protos && j < count; ++ j) {
+                    pointer_t proto_vmaddr = protos[j];
+                    const protocol_type* proto_obj = this->template at_vmaddr<protocol_type>(proto_vmaddr);
+                    if (!proto_obj)
+                        continue;
+                    this->template prepare_patch_objc_list<method_t<pointer_t> >(proto_obj->instanceMethods, proto_vmaddr + offsetof(protocol_type, instanceMethods));
+                    this->template prepare_patch_objc_list<method_t<pointer_t> >(proto_obj->classMethods, proto_vmaddr + offsetof(protocol_type, classMethods));
+                    this->template prepare_patch_objc_list<method_t<pointer_t> >(proto_obj->optionalInstanceMethods, proto_vmaddr + offsetof(protocol_type, optionalInstanceMethods));
+                    this->template prepare_patch_objc_list<method_t<pointer_t> >(proto_obj->optionalClassMethods, proto_vmaddr + offsetof(protocol_type, optionalClassMethods));
                 }
             } else if (streq(sect.sectname, "__objc_catlist")) {
-                const uint32_t* cats = _context->_f->peek_data_at<uint32_t>(sect.offset);
-                for (uint32_t j = 0; j < sect.size/4; ++ j) {
-                    uint32_t cat_vmaddr = cats[j];
-                    const category_t* cat_obj = reinterpret_cast<const category_t*>(_context->peek_char_at_vmaddr(cat_vmaddr));
-                    this->add_extlink_to(cat_obj->cls, cat_vmaddr + offsetof(category_t, cls));
-                    this->prepare_patch_objc_list<method_t>(cat_obj->instanceMethods, cat_vmaddr + offsetof(category_t, instanceMethods));
-                    this->prepare_patch_objc_list<method_t>(cat_obj->classMethods, cat_vmaddr + offsetof(category_t, classMethods));
+                const pointer_t* cats = this->template at_vmaddr<pointer_t>(sect.addr, count);
+                for (pointer_t j = 0; cats && j < count; ++ j) {
+                    pointer_t cat_vmaddr = cats[j];
+                    const category_type* cat_obj = this->template at_vmaddr<category_type>(cat_vmaddr);
+                    if (!cat_obj)
+                        continue;
+                    this->add_extlink_to(cat_obj->cls, cat_vmaddr + offsetof(category_type, cls));
+                    this->template prepare_patch_objc_list<method_t<pointer_t> >(cat_obj->instanceMethods, cat_vmaddr + offsetof(category_type, instanceMethods));
+                    this->template prepare_patch_objc_list<method_t<pointer_t> >(cat_obj->classMethods, cat_vmaddr + offsetof(category_type, classMethods));
                 }
             } else if (streq(sect.sectname, "__objc_imageinfo")) {
-                _imageinfo_address = sect.addr + 4;
-                uint32_t original_flag = *reinterpret_cast<const uint32_t*>(_context->peek_char_at_vmaddr(_imageinfo_address));
-                _imageinfo_replacement = original_flag & ~8;    // clear the OBJC_IMAGE_OPTIMIZED_BY_DYLD flag. (this chokes class-dump-3.3.3.)
-            } else if (streq(sect.sectname, "__objc_classrefs")) {
-                const uint32_t* refs = _context->_f->peek_data_at<uint32_t>(sect.offset);
-                uint32_t addr = sect.addr;
-                for (uint32_t j = 0; j < sect.size/4; ++ j, ++ refs, addr += 4) {
-                    this->add_extlink_to(*refs, addr);
+                const uint32_t* original_flag = this->template at_vmaddr<uint32_t>(sect.addr + 4);
+                if (original_flag) {
+                    _imageinfo_address = sect.addr + 4;
+                    _imageinfo_replacement = *original_flag & ~8;    // clear the OBJC_IMAGE_OPTIMIZED_BY_DYLD flag. (this chokes class-dump-3.3.3.)
                 }
+            } else if (streq(sect.sectname, "__objc_classrefs")) {
+                const pointer_t* refs = this->template at_vmaddr<pointer_t>(sect.addr, count);
+                std::vector<size_t> outliers;
+                if (refs)
+                    this->find_foreign_pointers(refs, count, &outliers);
+                BOOST_FOREACH(size_t j, outliers)
+                    this->add_extlink_to(refs[j], sect.addr + sizeof(pointer_t)*j);
             }
         }
     }
 }
 
+#if UNITTEST
+// Build with 'g++ -DUNITTEST dyld_decache.cpp DataFile.o', where DataFile.o is
+//  compiled without UNITTEST.
+#include <stdexcept>
+#include <set>
+
+#define XSTR(x) #x
+#define STR(x) XSTR(x)
+#define ASSERT(expr) if(!(expr)) { throw std::logic_error("Assert failed: " #expr " on line " STR(__LINE__)); }
+
+// A (segnum, offset, libord, symname) bound by the opcodes.
+typedef std::pair<std::pair<int, uint64_t>, std::pair<int, std::string> > DecodedBind;
+
+static uint64_t read_uleb128(const unsigned char*& p, const unsigned char* end) {
+    uint64_t result = 0;
+    int shift = 0;
+    do {
+        ASSERT(p < end);
+        result |= static_cast<uint64_t>(*p & 0x7F) << shift;
+        shift += 7;
+    } while (*p++ & 0x80);
+    return result;
+}
+
+// Run the bind opcodes the way dyld does, counting each opcode used.
+template <typename A>
+static void decode_binds(const unsigned char* p, size_t size, std::vector<DecodedBind>* binds, std::map<int, int>* opcode_counts) {
+    typedef typename A::pointer_t pointer_t;
+    const unsigned char* end = p + size;
+    int segnum = -1, libord = 0;
+    pointer_t address = 0;
+    std::string symname;
+    while (p < end) {
+        unsigned char opcode = *p & BIND_OPCODE_MASK;
+        unsigned char imm = *p & BIND_IMMEDIATE_MASK;
+        ++ p;
+        ++ (*opcode_counts)[opcode];
+        uint64_t count = 1, skip = 0;
+        switch (opcode) {
+            case BIND_OPCODE_DONE:
+                return;
+            case BIND_OPCODE_SET_DYLIB_ORDINAL_IMM:
+                libord = imm;
+                continue;
+            case BIND_OPCODE_SET_DYLIB_ORDINAL_ULEB:
+                libord = static_cast<int>(read_uleb128(p, end));
+                continue;
+            case BIND_OPCODE_SET_DYLIB_SPECIAL_IMM:
+                libord = imm ? static_cast<signed char>(BIND_OPCODE_MASK | imm) : 0;
+                continue;
+            case BIND_OPCODE_SET_SYMBOL_TRAILING_FLAGS_IMM:
+                symname = reinterpret_cast<const char*>(p);
+                p += symname.size() + 1;
+                ASSERT(p <= end);
+                continue;
+            case BIND_OPCODE_SET_TYPE_IMM:
+                continue;
+            case BIND_OPCODE_SET_SEGMENT_AND_OFFSET_ULEB:
+                segnum = imm;
+                address = static_cast<pointer_t>(read_uleb128(p, end));
+                continue;
+            case BIND_OPCODE_ADD_ADDR_ULEB:
+                address += static_cast<pointer_t>(read_uleb128(p, end));
+                continue;
+            case BIND_OPCODE_DO_BIND:
+                break;
+            case BIND_OPCODE_DO_BIND_ADD_ADDR_ULEB:
+                skip = read_uleb128(p, end);
+                break;
+            case BIND_OPCODE_DO_BIND_ADD_ADDR_IMM_SCALED:
+                skip = imm * sizeof(pointer_t);
+                break;
+            case BIND_OPCODE_DO_BIND_ULEB_TIMES_SKIPPING_ULEB:
+                count = read_uleb128(p, end);
+                skip = read_uleb128(p, end);
+                break;
+            default:
+                ASSERT(!"unexpected bind opcode");
+        }
+        ASSERT(segnum >= 0 && !symname.empty());
+        for (uint64_t i = 0; i < count; ++ i) {
+            binds->push_back(std::make_pair(std::make_pair(segnum, static_cast<uint64_t>(address)), std::make_pair(libord, symname)));
+            address += static_cast<pointer_t>(sizeof(pointer_t) + skip);
+        }
+    }
+}
+
+// Hands out the symbols of the targets 0, 1, 2, ... Some targets share a
+//  symbol, so that their entries are merged.
+template <typename A>
+struct BindTargets {
+    void get(typename A::pointer_t addr, const char** p_symname, int* p_libord) const {
+        static const char* const symnames[] = {"_a", "_b", "_OBJC_CLASS_$_C", "_d", "_e", "_f", "_a", "_b"};
+        static const int libords[] = {1, 1, 2, 17, -1, 300, 1, 3};
+        *p_symname = symnames[addr % 8];
+        *p_libord = libords[addr % 8];
+    }
+};
+
+// Encode the (target, segnum, offset) binds and check that decoding them
+//  binds each distinct location exactly once. Returns the encoded size.
+template <typename A>
+static size_t check_binds(const std::vector<std::pair<uint32_t, std::pair<int, uint32_t> > >& input, std::map<int, int>* opcode_counts) {
+    BindTargets<A> targets;
+    ExtraBindRepository<A> repo;
+    std::set<DecodedBind> expected;
+    for (size_t i = 0; i < input.size(); ++ i) {
+        repo.insert(input[i].first, input[i].second, &targets, &BindTargets<A>::get);
+        const char* symname;
+        int libord;
+        targets.get(input[i].first, &symname, &libord);
+        expected.insert(std::make_pair(std::make_pair(input[i].second.first, static_cast<uint64_t>(input[i].second.second)), std::make_pair(libord, std::string(symname))));
+    }
+
+    OutputImage image;
+    long size = repo.optimize_and_write(image);
+    ASSERT(size == image.tell());
+
+    // Read the opcodes back the way they are written out.
+    char filename[] = "/tmp/dd_unittest_XXXXXX";
+    close(mkstemp(filename));
+    MappedOutputFile f (filename);
+    ASSERT(image.flush(f) && f.tell() == size);
+    std::vector<DecodedBind> decoded;
+    decode_binds<A>(f.data(), static_cast<size_t>(size), &decoded, opcode_counts);
+    f.close();
+    unlink(filename);
+    ASSERT(decoded.size() == expected.size());
+    ASSERT(std::set<DecodedBind>(decoded.begin(), decoded.end()) == expected);
+    return static_cast<size_t>(size);
+}
+
+template <typename A>
+static void test_bind_encoding() {
+    typedef std::pair<uint32_t, std::pair<int, uint32_t> > Input;
+    const uint32_t ptr = sizeof(typename A::pointer_t);
+    std::map<int, int> counts;
+
+    // A run ending in DO_BIND_ULEB_TIMES_SKIPPING_ULEB, followed by another
+    //  run in the same segment which starts where it left off.
+    std::vector<Input> input;
+    for (uint32_t i = 0; i < 4; ++ i)
+        input.push_back(Input(0, std::make_pair(1, 0x100 + i * 4 * ptr)));
+    input.push_back(Input(1, std::make_pair(1, 0x100 + 4 * 4 * ptr)));
+    input.push_back(Input(1, std::make_pair(1, 0x100 + 5 * 4 * ptr)));
+    // SET_TYPE_IMM, SET_DYLIB_ORDINAL_IMM, SET_SYMBOL "_a", SET_SEGMENT 0x100,
+    //  TIMES 4 SKIPPING 3*ptr, SET_SYMBOL "_b", IMM_SCALED 3, DO_BIND.
+    ASSERT(check_binds<A>(input, &counts) == 1 + 1 + 4 + 3 + 3 + 4 + 1 + 1);
+    ASSERT(counts[BIND_OPCODE_DO_BIND_ULEB_TIMES_SKIPPING_ULEB] == 1);
+    ASSERT(counts[BIND_OPCODE_SET_SEGMENT_AND_OFFSET_ULEB] == 1);
+    ASSERT(counts[BIND_OPCODE_ADD_ADDR_ULEB] == 0);
+
+    // The same, where the last gap is free, and then where the next run lies
+    //  before the first one, in the same segment and in another one.
+    input.resize(4);
+    check_binds<A>(input, &counts);
+    input.push_back(Input(1, std::make_pair(1, 0x10)));
+    input.push_back(Input(2, std::make_pair(0, 0x10)));
+    input.push_back(Input(2, std::make_pair(1, 0x10000000)));
+    input.push_back(Input(3, std::make_pair(1, 0)));
+    check_binds<A>(input, &counts);
+
+    // Random binds, which are clustered to make runs and duplicates likely.
+    uint32_t seed = 1;
+    for (int round = 0; round < 500; ++ round) {
+        input.clear();
+        size_t count = round % 64;
+        for (size_t i = 0; i < count; ++ i) {
+            seed = seed * 1103515245 + 12345;
+            uint32_t target = (seed >> 8) % 8;
+            int segnum = static_cast<int>((seed >> 12) % 3);
+            uint32_t slot = (seed >> 16) % 48;
+            uint32_t stride = ((seed >> 24) & 1) ? 1 : 3;
+            input.push_back(Input(target, std::make_pair(segnum, slot * stride * ptr)));
+        }
+        check_binds<A>(input, &counts);
+    }
+}
+
+int main () {
+    try {
+        test_bind_encoding<Arch32>();
+        test_bind_encoding<Arch64>();
+    } catch (const std::logic_error& e) {
+        printf("Unit test failed with exception:\n%s\n\n", e.what());
+        return 1;
+    }
+
+    printf("Unit test finished.\n");
+
+    return 0;
+}
+#else
 int main(int argc, char* argv[]) {
     ProgramContext ctx;
     if (ctx.initialize(argc, argv)) {
@@ -1620,3 +3575,4 @@ int main(int argc, char* argv[]) {
 
     return 0;
 }
+#endif